@@ -21,15 +21,23 @@ classdef USRPHandle < handle
     end
     
     methods
-        function obj = USRPHandle(num_chan, fs, fc, rx_gain, tx_gain, addr)
+        function obj = USRPHandle(num_chan, fs, fc, rx_gain, tx_gain, addr, rx_chans_per_stream)
             %USRPHANDLE Construct a USRP instance
+            %   rx_chans_per_stream splits the rx channels across several
+            %   streamers, each received on its own thread (e.g. 1 for one
+            %   streamer per channel).  The default of 0 uses one streamer.
+            %   An addr of 'daemon' or 'daemon:<socket>|<device addr>'
+            %   runs the session in usrp_daemon (see README.md).
+            if nargin < 7
+                rx_chans_per_stream = 0;
+            end
             if nargin < 6
                 addr='';
             end
             if nargin < 5
                 tx_gain = rx_gain;
             end
-            obj.usrpPtr = usrp.usrp_mex('new', uint32(num_chan), fs, fc, rx_gain, tx_gain, addr);
+            obj.usrpPtr = usrp.usrp_mex('new', uint32(num_chan), fs, fc, rx_gain, tx_gain, addr, rx_chans_per_stream);
             obj.num_chan = num_chan;
         end
         
@@ -41,56 +49,36 @@ classdef USRPHandle < handle
             this.usrpPtr = [];
         end
         
-        function rx_dat = txrx_data(this, input_samples)
-            if size(input_samples, 2) == this.num_chan
-                input_samples = input_samples.';
-            end
+        function [rx_dat, gaps, timing] = txrx_data(this, input_samples)
+            %TXRX_DATA Transmit input_samples and receive the same number of samples
+            %   gaps has one [start, length] row (zero-based) for each run of
+            %   samples that was dropped (on any channel) and filled with zeros.  rx_dat has
+            %   one row per channel, or per beam when a beamformer is set
+            %   timing is [lead, startup, margin] in seconds: how long after
+            %   the device clock was reset the burst started, how long the
+            %   commands and filling the tx buffers took, and the time to spare.
+            %   The lead adapts to the startup times of recent bursts.
+            input_samples = this.check_tx_samples(input_samples);
             num_samp_rx = size(input_samples, 2);
             nchan = size(input_samples, 1);
-            if nchan ~= this.num_chan
-                error('Invalid matrix dimensions: one dimension must match the number of channels')
-            end
             % In Ubuntu, this points to a tmpfs location, so it should be RAM-backed
             tx_basename = tempname(getenv('XDG_RUNTIME_DIR'));
             rx_basename = tempname(getenv('XDG_RUNTIME_DIR'));
-            % Write out tx data to files
-            for ch=1:nchan
-                % C++ side expects that we index from 0
-                fh=fopen(sprintf('%s.%02d.dat', tx_basename, ch-1), 'w');
-                fwrite(fh, reshape([real(input_samples(ch,:)); imag(input_samples(ch,:))], 2*num_samp_rx,1), 'single');
-                fclose(fh);
-            end
             % Emulate a try/finally for this block to make sure that we clean up any temp files
             % https://www.mathworks.com/matlabcentral/answers/300062-finally-clause-in-try-catch
             txrx_err = [];
             try
+                % Write out tx data to files
+                this.write_tx_files(tx_basename, input_samples);
                 % Do tx/rx
-                usrp.usrp_mex('txrx', this.usrpPtr, num_samp_rx, nchan, ...
+                [gaps, timing, outputs] = usrp.usrp_mex('txrx', this.usrpPtr, num_samp_rx, nchan, ...
                     sprintf('%s.dat', tx_basename), sprintf('%s.dat', rx_basename));
+                this.check_gaps(gaps, nargout);
                 % Read rx data from files
-                rx_dat = zeros(nchan, num_samp_rx, 'single');
-                for ch=1:nchan
-                    fname = sprintf('%s.%02d.dat', rx_basename, ch-1);
-                    fh=fopen(fname, 'r');
-                    sample_mat=fread(fh, 'single');
-                    fclose(fh);
-                    sample_mat=reshape(sample_mat, 2, numel(sample_mat)/2);
-                    rx_dat(ch, :) = sample_mat(1,:) + 1j*sample_mat(2,:);
-                end
+                rx_dat = this.read_rx_files(rx_basename, outputs, num_samp_rx);
             catch txrx_err
             end
-            cleanup_err = [];
-            for ch=1:nchan
-                % Clean up
-                try
-                    delete(sprintf('%s.%02d.dat', rx_basename, ch-1));
-                catch cleanup_err
-                end
-                try
-                    delete(sprintf('%s.%02d.dat', tx_basename, ch-1));
-                catch cleanup_err
-                end
-            end
+            cleanup_err = this.cleanup_files({rx_basename, tx_basename});
              system('python /home/node1/Desktop/mmSDR_sparrow+/brige_test/disable_tx_mode.py');
              system('python /home/node1/Desktop/mmSDR_sparrow+/brige_test/disable_rx_mode.py');
             if ~isempty(txrx_err)
@@ -100,6 +88,244 @@ classdef USRPHandle < handle
             end
         end
 
+        function [rx_dat, gaps] = rx_only(this, num_samps, start_time)
+            %RX_ONLY Receive num_samps samples on every channel, without transmitting
+            %   gaps is the same as for txrx_data.  By default the capture
+            %   starts as soon as recent captures show is safe.
+            if nargin < 3
+                start_time = [];
+            end
+            rx_basename = tempname(getenv('XDG_RUNTIME_DIR'));
+            rx_err = [];
+            try
+                [gaps, outputs] = usrp.usrp_mex('rx', this.usrpPtr, num_samps, this.num_chan, ...
+                    sprintf('%s.dat', rx_basename), start_time);
+                this.check_gaps(gaps, nargout);
+                rx_dat = this.read_rx_files(rx_basename, outputs, num_samps);
+            catch rx_err
+            end
+            cleanup_err = this.cleanup_files({rx_basename});
+            if ~isempty(rx_err)
+                rethrow(rx_err)
+            elseif ~isempty(cleanup_err)
+                rethrow(cleanup_err)
+            end
+        end
+
+        function timing = tx_only(this, input_samples, start_time)
+            %TX_ONLY Transmit input_samples, without receiving
+            %   By default the lead time adapts as for txrx_data; timing is
+            %   [lead, startup, margin] in seconds.
+            if nargin < 3
+                start_time = [];
+            end
+            input_samples = this.check_tx_samples(input_samples);
+            tx_basename = tempname(getenv('XDG_RUNTIME_DIR'));
+            tx_err = [];
+            try
+                this.write_tx_files(tx_basename, input_samples);
+                timing = usrp.usrp_mex('tx', this.usrpPtr, this.num_chan, ...
+                    sprintf('%s.dat', tx_basename), start_time);
+            catch tx_err
+            end
+            cleanup_err = this.cleanup_files({tx_basename});
+            if ~isempty(tx_err)
+                rethrow(tx_err)
+            elseif ~isempty(cleanup_err)
+                rethrow(cleanup_err)
+            end
+        end
+
+        function [delays, peak_ratio] = calibrate_delay(this, search_samps, probe_len)
+            %CALIBRATE_DELAY Measure the tx to rx loopback delay of each channel
+            %   Transmits a Zadoff-Chu probe, with a different root on each
+            %   channel, and finds it in the capture by FFT cross-correlation.
+            %   delays (in samples) is cached for the current rate and
+            %   frequency, on disk as well, for use by set_delay_trim.
+            %   Delays up to search_samps (default 16384) can be found.
+            %   peak_ratio is the correlation peak over its mean; a small
+            %   value means the probe wasn't received clearly.
+            if nargin < 3
+                probe_len = 4093; % prime, so every root is usable
+            end
+            if nargin < 2
+                search_samps = 16384;
+            end
+            n = 0:probe_len-1;
+            roots = (1:this.num_chan).';
+            probe = 0.5 * exp(-1j*pi*roots.*(n.*(n+1))/probe_len);
+            tx_basename = tempname(getenv('XDG_RUNTIME_DIR'));
+            rx_basename = tempname(getenv('XDG_RUNTIME_DIR'));
+            cal_err = [];
+            try
+                this.write_tx_files(tx_basename, probe);
+                [delays, peak_ratio] = usrp.usrp_mex('calibrate_delay', this.usrpPtr, ...
+                    probe_len + search_samps, this.num_chan, ...
+                    sprintf('%s.dat', tx_basename), sprintf('%s.dat', rx_basename));
+            catch cal_err
+            end
+            cleanup_err = this.cleanup_files({rx_basename, tx_basename});
+            if ~isempty(cal_err)
+                rethrow(cal_err)
+            elseif ~isempty(cleanup_err)
+                rethrow(cleanup_err)
+            end
+        end
+
+        function delays = set_delay_trim(this, enable)
+            %SET_DELAY_TRIM Start txrx_data captures at the loopback delay
+            %   With this on, each column of rx_dat starts where the
+            %   transmitted waveform arrives on that channel, using the
+            %   delays from calibrate_delay for the current rate and
+            %   frequency, so the channels line up.
+            %   Returns the delays in use, or [] if none are cached.
+            delays = usrp.usrp_mex('set_delay_trim', this.usrpPtr, logical(enable));
+        end
+
+        function [manifest, gaps] = rx_to_files(this, basepath, num_samps, segment_samps, start_time)
+            %RX_TO_FILES Receive num_samps samples per channel straight to files
+            %   For captures too large to return to Matlab.  If segment_samps
+            %   is nonzero, the output rotates to new files every segment_samps
+            %   samples.  Returns the path of a manifest listing the files
+            %   (see read_manifest) and the gap map.
+            if nargin < 5
+                start_time = 0.005;
+            end
+            if nargin < 4
+                segment_samps = 0;
+            end
+            if num_samps == 0
+                error('rx_to_files: num_samps must be nonzero; use rx_files_start for unlimited captures');
+            end
+            this.rx_files_start(basepath, num_samps, segment_samps, start_time);
+            [manifest, gaps] = usrp.usrp_mex('rx_files_stop', this.usrpPtr, true);
+        end
+
+        function rx_files_start(this, basepath, num_samps, segment_samps, start_time)
+            %RX_FILES_START Start receiving to files in the background
+            %   Same as rx_to_files, but returns immediately.  num_samps may
+            %   be 0 to receive until rx_files_stop is called.
+            if nargin < 5
+                start_time = 0.005;
+            end
+            if nargin < 4
+                segment_samps = 0;
+            end
+            usrp.usrp_mex('rx_files_start', this.usrpPtr, num_samps, this.num_chan, ...
+                basepath, start_time, segment_samps);
+        end
+
+        function [manifest, gaps] = rx_files_stop(this)
+            %RX_FILES_STOP Stop a background capture and write its manifest
+            [manifest, gaps] = usrp.usrp_mex('rx_files_stop', this.usrpPtr, false);
+        end
+
+        function ring_start(this, ring_samps, backing_file, start_time)
+            %RING_START Receive continuously into a circular buffer
+            %   Keeps the last ring_samps samples of every channel, in memory,
+            %   or in a memory-mapped backing_file if one is given.  Follow
+            %   with ring_trigger to retrieve the samples around an event.
+            %   By default the capture starts as soon as recent starts show
+            %   is safe, and this waits for the first samples; a late start
+            %   is an error, and the next start allows more time.
+            if nargin < 4
+                start_time = [];
+            end
+            if nargin < 3
+                backing_file = '';
+            end
+            usrp.usrp_mex('ring_start', this.usrpPtr, this.num_chan, ring_samps, ...
+                backing_file, start_time);
+        end
+
+        function [rx_dat, trigger_time, gaps] = ring_trigger(this, num_pre, num_post, source, arg)
+            %RING_TRIGGER Freeze the ring and return the samples around a trigger
+            %   rx_dat has num_pre samples before the trigger and num_post
+            %   samples from it onwards.  source is 'now' (the default), 'time'
+            %   (arg is a device time in seconds) or 'gpio' (arg is
+            %   [fp0_bit, timeout]; waits for a rising edge).  trigger_time is
+            %   the device time of the trigger.  The gpio pin is polled, so
+            %   its trigger_time can be early by one poll (typically well
+            %   under a millisecond); widen num_pre/num_post to cover it.
+            %   Call ring_start to re-arm.
+            if nargin < 4
+                source = 'now';
+            end
+            rx_basename = tempname(getenv('XDG_RUNTIME_DIR'));
+            trig_err = [];
+            try
+                if nargin < 5
+                    [trigger_time, gaps, outputs] = usrp.usrp_mex('ring_trigger', this.usrpPtr, ...
+                        num_pre, num_post, sprintf('%s.dat', rx_basename), source);
+                else
+                    [trigger_time, gaps, outputs] = usrp.usrp_mex('ring_trigger', this.usrpPtr, ...
+                        num_pre, num_post, sprintf('%s.dat', rx_basename), source, double(arg));
+                end
+                this.check_gaps(gaps, nargout - 1);
+                rx_dat = this.read_rx_files(rx_basename, outputs, num_pre + num_post);
+            catch trig_err
+            end
+            cleanup_err = this.cleanup_files({rx_basename});
+            if ~isempty(trig_err)
+                rethrow(trig_err)
+            elseif ~isempty(cleanup_err)
+                rethrow(cleanup_err)
+            end
+        end
+
+        function ring_stop(this)
+            %RING_STOP Stop the ring capture and release its buffer
+            usrp.usrp_mex('ring_stop', this.usrpPtr);
+        end
+
+        function set_stream_threads(this, rx_cpu, rx_priority, tx_cpu, tx_priority)
+            %SET_STREAM_THREADS Pin the rx and tx streaming threads to cores
+            %   Cores are numbered from 0 as in Linux; use -1 to leave a thread
+            %   unpinned.  Priorities are SCHED_FIFO priorities (1-99), or 0
+            %   for the UHD default.
+            if nargin < 5
+                tx_priority = rx_priority;
+            end
+            if nargin < 4
+                tx_cpu = -1;
+            end
+            usrp.usrp_mex('set_stream_threads', this.usrpPtr, rx_cpu, rx_priority, tx_cpu, tx_priority);
+        end
+
+        function set_iq_correction(this, dc_offset, gain, imbalance)
+            %SET_IQ_CORRECTION Correct rx samples as they are received
+            %   Each argument has one entry per channel.  Received samples x
+            %   become gain .* (z + imbalance .* conj(z)), z = x - dc_offset.
+            %   Call with no arguments to turn correction off.
+            if nargin < 2
+                dc_offset = [];
+                gain = [];
+                imbalance = [];
+            end
+            if nargin < 4
+                imbalance = zeros(size(dc_offset));
+            end
+            if nargin < 3
+                gain = ones(size(dc_offset));
+            end
+            usrp.usrp_mex('set_iq_correction', this.usrpPtr, double(dc_offset), ...
+                double(gain), double(imbalance));
+        end
+
+        function set_beamformer(this, weights)
+            %SET_BEAMFORMER Return beams instead of raw rx channels
+            %   weights is num_beams x num_chan; beam k is weights(k,:) times
+            %   the (corrected) channels.  Call with no arguments to return
+            %   raw channels again.
+            if nargin < 2
+                weights = [];
+            end
+            if ~isempty(weights) && size(weights, 2) ~= this.num_chan
+                error('Beamforming weights must have one column per channel')
+            end
+            usrp.usrp_mex('set_beamformer', this.usrpPtr, double(weights));
+        end
+
         function set_rx_gain(this, manual_gain, agc)
             usrp.usrp_mex('set_gain_rx', this.usrpPtr, manual_gain, agc);
         end
@@ -126,4 +352,99 @@ classdef USRPHandle < handle
             usrp.usrp_mex('gpio_spi_msg', this.usrpPtr, input_uints);
         end
     end
+
+    methods (Static)
+        function info = read_manifest(manifest)
+            %READ_MANIFEST Parse a capture manifest written by rx_to_files
+            %   info.files is a table with one row per file (output, segment,
+            %   first_sample, num_samps, path); info.gaps has one
+            %   [start, length] row per gap.  All indices are zero-based.
+            fh = fopen(manifest, 'r');
+            if fh < 0
+                error('Could not open manifest %s', manifest);
+            end
+            info = struct('rate', NaN, 'num_samps', 0, 'segment_samps', 0, ...
+                'files', [], 'gaps', zeros(0, 2));
+            output = []; segment = []; first_sample = []; num_samps = []; path = {};
+            line = fgetl(fh);
+            while ischar(line)
+                parts = strsplit(strtrim(line));
+                switch parts{1}
+                    case {'rate', 'num_samps', 'segment_samps'}
+                        info.(parts{1}) = str2double(parts{2});
+                    case 'file'
+                        output(end+1, 1) = str2double(parts{2}); %#ok<AGROW>
+                        segment(end+1, 1) = str2double(parts{3}); %#ok<AGROW>
+                        first_sample(end+1, 1) = str2double(parts{4}); %#ok<AGROW>
+                        num_samps(end+1, 1) = str2double(parts{5}); %#ok<AGROW>
+                        path{end+1, 1} = strjoin(parts(6:end), ' '); %#ok<AGROW>
+                    case 'gap'
+                        info.gaps(end+1, :) = str2double(parts(2:3));
+                end
+                line = fgetl(fh);
+            end
+            fclose(fh);
+            info.files = table(output, segment, first_sample, num_samps, path);
+        end
+    end
+
+    methods (Access = private)
+        function input_samples = check_tx_samples(this, input_samples)
+            % Samples are stored one channel per row
+            if size(input_samples, 2) == this.num_chan
+                input_samples = input_samples.';
+            end
+            if size(input_samples, 1) ~= this.num_chan
+                error('Invalid matrix dimensions: one dimension must match the number of channels')
+            end
+        end
+
+        function check_gaps(~, gaps, nout)
+            % Callers that don't ask for the gap map still hear about drops
+            % (nout counts outputs up to and including the gap map)
+            if nout < 2 && ~isempty(gaps)
+                warning('USRPHandle:gaps', '%d runs of dropped samples were filled with zeros', ...
+                    size(gaps, 1));
+            end
+        end
+
+        function write_tx_files(~, basename, input_samples)
+            num_samp = size(input_samples, 2);
+            for ch=1:size(input_samples, 1)
+                % C++ side expects that we index from 0
+                fh=fopen(sprintf('%s.%02d.dat', basename, ch-1), 'w');
+                fwrite(fh, reshape([real(input_samples(ch,:)); imag(input_samples(ch,:))], 2*num_samp,1), 'single');
+                fclose(fh);
+            end
+        end
+
+        function rx_dat = read_rx_files(~, basename, outputs, num_samp)
+            % outputs lists the (zero-based) files written, one per channel
+            % or per beam, as reported by usrp_mex
+            rx_dat = zeros(numel(outputs), num_samp, 'single');
+            for ch=1:numel(outputs)
+                fname = sprintf('%s.%02d.dat', basename, outputs(ch));
+                fh=fopen(fname, 'r');
+                sample_mat=fread(fh, 'single');
+                fclose(fh);
+                sample_mat=reshape(sample_mat, 2, numel(sample_mat)/2);
+                rx_dat(ch, :) = sample_mat(1,:) + 1j*sample_mat(2,:);
+            end
+        end
+
+        function cleanup_err = cleanup_files(~, basenames)
+            % Remove every per-channel (or per-beam) file of each base name
+            cleanup_err = [];
+            for ii=1:numel(basenames)
+                [dirname, name] = fileparts(basenames{ii});
+                files = dir(fullfile(dirname, sprintf('%s.*.dat', name)));
+                for jj=1:numel(files)
+                    try
+                        delete(fullfile(files(jj).folder, files(jj).name));
+                    catch cleanup_err
+                    end
+                end
+            end
+        end
+    end
 end
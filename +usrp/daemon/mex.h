@@ -0,0 +1,75 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//// Minimal stand-in for Matlab's mex.h, so usrp_daemon can run the same
+//// command handlers as the MEX file.  Only what usrp_mex.cpp uses is here.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+
+typedef enum {
+    mxUNKNOWN_CLASS,
+    mxLOGICAL_CLASS,
+    mxCHAR_CLASS,
+    mxDOUBLE_CLASS,
+    mxSINGLE_CLASS,
+    mxUINT8_CLASS,
+    mxUINT32_CLASS,
+    mxUINT64_CLASS
+} mxClassID;
+
+typedef enum { mxREAL, mxCOMPLEX } mxComplexity;
+
+typedef struct { double real, imag; } mxComplexDouble;
+
+struct mxArray;
+
+//! Thrown by mexErrMsgTxt; the daemon sends the message back to the client
+struct mex_error : public std::runtime_error {
+    mex_error(const char *msg) : std::runtime_error(msg) { }
+};
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+
+void mexErrMsgTxt(const char *msg);
+void mexWarnMsgTxt(const char *msg);
+inline void mexLock() { }
+inline void mexUnlock() { }
+
+mxArray *mxCreateNumericMatrix(size_t m, size_t n, mxClassID cls, mxComplexity complexity);
+mxArray *mxCreateDoubleMatrix(size_t m, size_t n, mxComplexity complexity);
+mxArray *mxCreateDoubleScalar(double val);
+mxArray *mxCreateString(const char *str);
+mxArray *mxCreateLogicalMatrix(size_t m, size_t n);
+void mxDestroyArray(mxArray *arr);
+
+mxClassID mxGetClassID(const mxArray *arr);
+size_t mxGetM(const mxArray *arr);
+size_t mxGetN(const mxArray *arr);
+void mxSetM(mxArray *arr, size_t m);
+void mxSetN(mxArray *arr, size_t n);
+size_t mxGetNumberOfElements(const mxArray *arr);
+size_t mxGetElementSize(const mxArray *arr);
+bool mxIsComplex(const mxArray *arr);
+bool mxIsScalar(const mxArray *arr);
+inline bool mxIsEmpty(const mxArray *arr) { return mxGetNumberOfElements(arr) == 0; }
+inline bool mxIsChar(const mxArray *arr) { return mxGetClassID(arr) == mxCHAR_CLASS; }
+inline bool mxIsDouble(const mxArray *arr) { return mxGetClassID(arr) == mxDOUBLE_CLASS; }
+inline bool mxIsUint8(const mxArray *arr) { return mxGetClassID(arr) == mxUINT8_CLASS; }
+
+void *mxGetData(const mxArray *arr);
+inline double *mxGetDoubles(const mxArray *arr) { return (double *) mxGetData(arr); }
+inline mxComplexDouble *mxGetComplexDoubles(const mxArray *arr) { return (mxComplexDouble *) mxGetData(arr); }
+inline uint8_t *mxGetUint8s(const mxArray *arr) { return (uint8_t *) mxGetData(arr); }
+int mxSetDoubles(mxArray *arr, double *data);
+double mxGetScalar(const mxArray *arr);
+int mxGetString(const mxArray *arr, char *buf, size_t buflen);
+char *mxArrayToString(const mxArray *arr);
+inline void mxFree(void *ptr) { free(ptr); }
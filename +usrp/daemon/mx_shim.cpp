@@ -0,0 +1,155 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "mex.h"
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// Char arrays hold one byte per character, unlike Matlab's UTF-16
+struct mxArray {
+    mxClassID cls;
+    bool complex;
+    size_t m, n;
+    std::vector<char> data;
+};
+
+static size_t class_size(mxClassID cls)
+{
+    switch (cls) {
+        case mxLOGICAL_CLASS:
+        case mxCHAR_CLASS:
+        case mxUINT8_CLASS:
+            return 1;
+        case mxSINGLE_CLASS:
+        case mxUINT32_CLASS:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+void mexErrMsgTxt(const char *msg)
+{
+    throw mex_error(msg);
+}
+
+void mexWarnMsgTxt(const char *msg)
+{
+    std::cerr << "Warning: " << msg << std::endl;
+}
+
+mxArray *mxCreateNumericMatrix(size_t m, size_t n, mxClassID cls, mxComplexity complexity)
+{
+    mxArray *arr = new mxArray;
+    arr->cls = cls;
+    arr->complex = (complexity == mxCOMPLEX);
+    arr->m = m;
+    arr->n = n;
+    arr->data.resize(m * n * mxGetElementSize(arr));
+    return arr;
+}
+
+mxArray *mxCreateDoubleMatrix(size_t m, size_t n, mxComplexity complexity)
+{
+    return mxCreateNumericMatrix(m, n, mxDOUBLE_CLASS, complexity);
+}
+
+mxArray *mxCreateDoubleScalar(double val)
+{
+    mxArray *arr = mxCreateDoubleMatrix(1, 1, mxREAL);
+    *mxGetDoubles(arr) = val;
+    return arr;
+}
+
+mxArray *mxCreateString(const char *str)
+{
+    size_t len = strlen(str);
+    mxArray *arr = mxCreateNumericMatrix(1, len, mxCHAR_CLASS, mxREAL);
+    memcpy(arr->data.data(), str, len);
+    return arr;
+}
+
+mxArray *mxCreateLogicalMatrix(size_t m, size_t n)
+{
+    return mxCreateNumericMatrix(m, n, mxLOGICAL_CLASS, mxREAL);
+}
+
+void mxDestroyArray(mxArray *arr)
+{
+    delete arr;
+}
+
+mxClassID mxGetClassID(const mxArray *arr) { return arr->cls; }
+size_t mxGetM(const mxArray *arr) { return arr->m; }
+size_t mxGetN(const mxArray *arr) { return arr->n; }
+size_t mxGetNumberOfElements(const mxArray *arr) { return arr->m * arr->n; }
+size_t mxGetElementSize(const mxArray *arr) { return class_size(arr->cls) * (arr->complex ? 2 : 1); }
+bool mxIsComplex(const mxArray *arr) { return arr->complex; }
+bool mxIsScalar(const mxArray *arr) { return mxGetNumberOfElements(arr) == 1; }
+void *mxGetData(const mxArray *arr) { return (void *) arr->data.data(); }
+
+void mxSetM(mxArray *arr, size_t m)
+{
+    arr->m = m;
+    arr->data.resize(arr->m * arr->n * mxGetElementSize(arr));
+}
+
+void mxSetN(mxArray *arr, size_t n)
+{
+    arr->n = n;
+    arr->data.resize(arr->m * arr->n * mxGetElementSize(arr));
+}
+
+// Matlab takes ownership of data here; we copy it, which also copes with
+// callers that pass a stack buffer
+int mxSetDoubles(mxArray *arr, double *data)
+{
+    memcpy(arr->data.data(), data, arr->data.size());
+    return 1;
+}
+
+double mxGetScalar(const mxArray *arr)
+{
+    if (arr->data.empty()) {
+        return 0;
+    }
+    const char *p = arr->data.data();
+    switch (arr->cls) {
+        case mxLOGICAL_CLASS:
+        case mxCHAR_CLASS:
+        case mxUINT8_CLASS:
+            return *(const uint8_t *) p;
+        case mxSINGLE_CLASS:
+            return *(const float *) p;
+        case mxUINT32_CLASS:
+            return *(const uint32_t *) p;
+        case mxUINT64_CLASS:
+            return (double) *(const uint64_t *) p;
+        default:
+            return *(const double *) p;
+    }
+}
+
+int mxGetString(const mxArray *arr, char *buf, size_t buflen)
+{
+    if (arr->cls != mxCHAR_CLASS || buflen == 0) {
+        return 1;
+    }
+    size_t len = std::min(arr->data.size(), buflen - 1);
+    memcpy(buf, arr->data.data(), len);
+    buf[len] = '\0';
+    return (len < arr->data.size()) ? 1 : 0;
+}
+
+char *mxArrayToString(const mxArray *arr)
+{
+    if (arr->cls != mxCHAR_CLASS) {
+        return NULL;
+    }
+    char *str = (char *) malloc(arr->data.size() + 1);
+    memcpy(str, arr->data.data(), arr->data.size());
+    str[arr->data.size()] = '\0';
+    return str;
+}
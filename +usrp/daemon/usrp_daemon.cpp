@@ -0,0 +1,181 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//// Runs the usrp_mex commands in a long-lived process, so the radio session
+//// survives Matlab restarts and several Matlab processes can share it.
+////
+//// usage: usrp_daemon [socket_path]
+
+#include "mex.h"
+#include "../usrp_mex_util.hpp"
+#include "../usrp_wire.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// No command comes close to this many inputs or outputs
+#define WIRE_MAX_ARGS 32
+
+// The device, shared by every session, is created by the first 'new'
+extern usrp_access *global_usrp;
+
+// 'new' opens or reconfigures the device, so only one runs at a time
+static std::mutex new_lock;
+
+/* Commands that only touch the calling session's settings, which can run
+ * while another session streams.  Every other command needs the device.
+ */
+static bool is_session_command(const char *cmd)
+{
+    static const char *session_cmds[] = {"set_stream_threads", "set_iq_correction",
+        "set_beamformer", "set_delay_trim", "set_gain_rx", "set_gain_tx", "get_gain_rx"};
+    for (const char *name : session_cmds) {
+        if (!strcmp(name, cmd)) return true;
+    }
+    return false;
+}
+
+static void send_error(int fd, const std::string& msg)
+{
+    uint8_t status = WIRE_STATUS_ERROR;
+    wire_write(fd, &status, sizeof(status)) && wire_write_string(fd, msg);
+}
+
+/* Run one call from the client.  Commands on one session run one at a time,
+ * and so do commands that use the device; otherwise clients don't wait for
+ * each other.  Handles created by 'new' are added to handles.
+ */
+static bool handle_call(int fd, std::vector<uint64_t>& handles)
+{
+    uint32_t counts[2];
+    if (!wire_read(fd, counts, sizeof(counts)) || counts[0] > WIRE_MAX_ARGS || counts[1] > WIRE_MAX_ARGS)
+        return false;
+    int nlhs = counts[0];
+    std::vector<const mxArray *> prhs;
+    bool ok = true;
+    for (uint32_t ii = 0; ok && ii < counts[1]; ii++) {
+        mxArray *arr = wire_read_array(fd);
+        ok = (arr != NULL);
+        if (ok) prhs.push_back(arr);
+    }
+    std::vector<mxArray *> plhs(std::max(nlhs, 1), (mxArray *) NULL);
+    std::string err;
+    char cmd[64] = "";
+    if (ok && !prhs.empty() && mxIsChar(prhs[0])) {
+        mxGetString(prhs[0], cmd, sizeof(cmd));
+    }
+    bool is_new = !strcmp("new", cmd);
+    if (ok) {
+        std::unique_lock<std::mutex> session_guard, device_guard;
+        // Keep the session alive while its command runs, even if its
+        // client goes away meanwhile
+        std::shared_ptr<usrp_access> inst = (prhs.size() >= 2) ? findHandle(prhs[1]) : nullptr;
+        if (is_new) {
+            session_guard = std::unique_lock<std::mutex>(new_lock);
+            if (global_usrp != NULL) {
+                device_guard = std::unique_lock<std::mutex>(global_usrp->streams->lock);
+            }
+        } else if (inst) {
+            session_guard = std::unique_lock<std::mutex>(inst->session->lock);
+            if (!is_session_command(cmd)) {
+                device_guard = std::unique_lock<std::mutex>(inst->streams->lock);
+            }
+        }
+        try {
+            mexFunction(nlhs, plhs.data(), prhs.size(), prhs.data());
+        } catch (const std::exception& e) {
+            // mexErrMsgTxt, and anything UHD throws
+            err = e.what();
+        }
+    }
+    if (is_new && err.empty() && plhs[0] != NULL && mxGetClassID(plhs[0]) == mxUINT64_CLASS) {
+        handles.push_back(*((uint64_t *)mxGetData(plhs[0])));
+    }
+    for (const mxArray *arr : prhs) mxDestroyArray((mxArray *) arr);
+    // Matlab allows one output to go unset when nlhs is 0
+    uint32_t nout = 0;
+    while ((int) nout < std::max(nlhs, 1) && plhs[nout] != NULL) nout++;
+    if (ok && err.empty()) {
+        uint8_t status = WIRE_STATUS_OK;
+        ok = wire_write(fd, &status, sizeof(status)) && wire_write(fd, &nout, sizeof(nout));
+        for (uint32_t ii = 0; ok && ii < nout; ii++) {
+            ok = wire_write_array(fd, plhs[ii]);
+        }
+    } else if (ok) {
+        send_error(fd, err);
+    }
+    for (mxArray *arr : plhs) {
+        if (arr != NULL) mxDestroyArray(arr);
+    }
+    return ok;
+}
+
+static void serve_client(int fd)
+{
+    std::vector<uint64_t> handles;
+    // A bad request only costs this client its connection
+    try {
+        while (handle_call(fd, handles)) { }
+    } catch (const std::exception& e) {
+        std::cerr << "usrp_daemon: dropping client: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "usrp_daemon: dropping client" << std::endl;
+    }
+    close(fd);
+    // Sessions end with their connection; the device and any captures
+    // running on it stay for the next client
+    for (uint64_t handle : handles) {
+        releaseHandle(handle);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string path = (argc > 1) ? argv[1] : default_daemon_socket();
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    // Clients that go away mid-reply shouldn't take the daemon with them
+    signal(SIGPIPE, SIG_IGN);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // Remove a socket left behind by a previous run
+    unlink(path.c_str());
+    // Only the owner may connect; samples are passed as files in their
+    // runtime directory anyway
+    mode_t old_mask = umask(0077);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(listen_fd, 8) != 0) {
+        perror("usrp_daemon");
+        return 1;
+    }
+    umask(old_mask);
+    std::cout << "usrp_daemon listening on " << path << std::endl;
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        std::thread(serve_client, fd).detach();
+    }
+    close(listen_fd);
+    unlink(path.c_str());
+    return 0;
+}
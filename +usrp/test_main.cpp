@@ -126,9 +126,9 @@ int main() {
     md.time_spec = uhd::time_spec_t(start_time);
     // tx MUST be run in a thread to avoid accidentally giving the Matlab main thread realtime priority
     boost::thread_group transmit_thread;
-    transmit_thread.create_thread(boost::bind(&send_from_file, tx_stream, std::string(tx_basepath), 1000, chans.size(), md));
+    transmit_thread.create_thread(boost::bind(&send_from_file, tx_stream, std::string(tx_basepath), 1000, chans.size(), md, stream_thread_opts(), (tx_timing *) NULL));
     auto spb = tx_stream->get_max_num_samps() * 10;
-    recv_to_file_fc(rx_usrp, rx_stream, std::string(rx_basepath), spb, num_samp_rx, start_time, chans);
+    recv_to_file_fc(rx_usrp, rx_stream, std::string(rx_basepath), spb, num_samp_rx, start_time, chans, rx_processing(), 0, NULL);
     std::cout << "?1\n";
     transmit_thread.join_all();
     std::cout << "?1\n";
@@ -0,0 +1,259 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "usrp_dsp.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/***********************************************************************
+ * IQ correction
+ **********************************************************************/
+iq_correction make_iq_correction(std::complex<double> dc_offset,
+    std::complex<double> gain,
+    std::complex<double> imbalance)
+{
+    // gain*z + (gain*imbalance)*conj(z), written out in real and imaginary parts
+    std::complex<double> a = gain;
+    std::complex<double> b = gain * imbalance;
+    iq_correction corr;
+    corr.dc_re = dc_offset.real();
+    corr.dc_im = dc_offset.imag();
+    corr.m00 = a.real() + b.real();
+    corr.m01 = b.imag() - a.imag();
+    corr.m10 = a.imag() + b.imag();
+    corr.m11 = a.real() - b.real();
+    return corr;
+}
+
+//! Correct num_samps interleaved samples in place
+void apply_iq_correction(std::complex<float> *buff, size_t num_samps, const iq_correction &corr)
+{
+    float *data = reinterpret_cast<float*>(buff);
+    size_t i = 0;
+    // Each register holds [re0 im0 re1 im1 ...].  Multiplying by the diagonal
+    // and by the re/im-swapped samples times the off-diagonal gives the matrix
+    // product for every sample at once.
+#ifdef __AVX__
+    const __m256 dc8 = _mm256_setr_ps(corr.dc_re, corr.dc_im, corr.dc_re, corr.dc_im,
+        corr.dc_re, corr.dc_im, corr.dc_re, corr.dc_im);
+    const __m256 diag8 = _mm256_setr_ps(corr.m00, corr.m11, corr.m00, corr.m11,
+        corr.m00, corr.m11, corr.m00, corr.m11);
+    const __m256 cross8 = _mm256_setr_ps(corr.m01, corr.m10, corr.m01, corr.m10,
+        corr.m01, corr.m10, corr.m01, corr.m10);
+    for (; i + 4 <= num_samps; i += 4) {
+        __m256 z = _mm256_sub_ps(_mm256_loadu_ps(data + 2*i), dc8);
+        __m256 swapped = _mm256_permute_ps(z, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm256_storeu_ps(data + 2*i,
+            _mm256_add_ps(_mm256_mul_ps(z, diag8), _mm256_mul_ps(swapped, cross8)));
+    }
+#endif
+#ifdef __SSE2__
+    const __m128 dc = _mm_setr_ps(corr.dc_re, corr.dc_im, corr.dc_re, corr.dc_im);
+    const __m128 diag = _mm_setr_ps(corr.m00, corr.m11, corr.m00, corr.m11);
+    const __m128 cross = _mm_setr_ps(corr.m01, corr.m10, corr.m01, corr.m10);
+    for (; i + 2 <= num_samps; i += 2) {
+        __m128 z = _mm_sub_ps(_mm_loadu_ps(data + 2*i), dc);
+        __m128 swapped = _mm_shuffle_ps(z, z, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_ps(data + 2*i, _mm_add_ps(_mm_mul_ps(z, diag), _mm_mul_ps(swapped, cross)));
+    }
+#endif
+    // Whatever is left over (or everything, without SSE)
+    for (; i < num_samps; i++) {
+        float re = data[2*i] - corr.dc_re;
+        float im = data[2*i+1] - corr.dc_im;
+        data[2*i] = corr.m00*re + corr.m01*im;
+        data[2*i+1] = corr.m10*re + corr.m11*im;
+    }
+}
+
+/***********************************************************************
+ * Beamforming
+ **********************************************************************/
+// Samples per block, so that a block of every channel and beam stays in L1
+#define BEAM_BLOCK_SAMPS 256
+
+//! beam[i] = sum_n weights[n] * chans[n][offset + i] for num_samps interleaved
+//  samples.  The sums for a few samples are kept in registers while every
+//  channel is added in, so each beam sample is only stored once.
+static void beam_combine(const std::complex<float> *weights,
+    const std::vector<std::complex<float>*> &chans,
+    size_t offset,
+    std::complex<float> *beam,
+    size_t num_samps)
+{
+    const size_t num_chans = chans.size();
+    const float *w = reinterpret_cast<const float*>(weights);
+    float *y = reinterpret_cast<float*>(beam);
+    size_t i = 0;
+    // Same trick as the IQ correction: x*wr plus the re/im-swapped x times
+    // [-wi wi] is the complex product.  The sign is applied once, after the
+    // channel loop.
+#ifdef __AVX__
+    const __m256 sign8 = _mm256_setr_ps(-1, 1, -1, 1, -1, 1, -1, 1);
+    for (; i + 4 <= num_samps; i += 4) {
+        __m256 acc = _mm256_setzero_ps();
+        __m256 acc_swapped = _mm256_setzero_ps();
+        for (size_t n = 0; n < num_chans; n++) {
+            __m256 xv = _mm256_loadu_ps(reinterpret_cast<const float*>(chans[n] + offset) + 2*i);
+            __m256 swapped = _mm256_permute_ps(xv, _MM_SHUFFLE(2, 3, 0, 1));
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(xv, _mm256_set1_ps(w[2*n])));
+            acc_swapped = _mm256_add_ps(acc_swapped, _mm256_mul_ps(swapped, _mm256_set1_ps(w[2*n+1])));
+        }
+        _mm256_storeu_ps(y + 2*i, _mm256_add_ps(acc, _mm256_mul_ps(acc_swapped, sign8)));
+    }
+#endif
+#ifdef __SSE2__
+    const __m128 sign4 = _mm_setr_ps(-1, 1, -1, 1);
+    for (; i + 2 <= num_samps; i += 2) {
+        __m128 acc = _mm_setzero_ps();
+        __m128 acc_swapped = _mm_setzero_ps();
+        for (size_t n = 0; n < num_chans; n++) {
+            __m128 xv = _mm_loadu_ps(reinterpret_cast<const float*>(chans[n] + offset) + 2*i);
+            __m128 swapped = _mm_shuffle_ps(xv, xv, _MM_SHUFFLE(2, 3, 0, 1));
+            acc = _mm_add_ps(acc, _mm_mul_ps(xv, _mm_set1_ps(w[2*n])));
+            acc_swapped = _mm_add_ps(acc_swapped, _mm_mul_ps(swapped, _mm_set1_ps(w[2*n+1])));
+        }
+        _mm_storeu_ps(y + 2*i, _mm_add_ps(acc, _mm_mul_ps(acc_swapped, sign4)));
+    }
+#endif
+    for (; i < num_samps; i++) {
+        std::complex<float> sum;
+        for (size_t n = 0; n < num_chans; n++) {
+            sum += weights[n] * chans[n][offset + i];
+        }
+        beam[i] = sum;
+    }
+}
+
+//! Combine the channel buffers into beams, beam[k] = sum_n w[k][n] * chan[n].
+//  This is a complex matrix product, blocked over samples so each block of
+//  channel data is reused from cache for every beam, with each beam's sums
+//  accumulated in registers across the channels.
+void beamform(const rx_processing &proc,
+    const std::vector<std::complex<float>*> &chan_buffs,
+    const std::vector<std::complex<float>*> &beam_buffs,
+    size_t num_samps)
+{
+    const size_t num_chans = chan_buffs.size();
+    for (size_t start = 0; start < num_samps; start += BEAM_BLOCK_SAMPS) {
+        size_t len = std::min<size_t>(BEAM_BLOCK_SAMPS, num_samps - start);
+        for (size_t k = 0; k < proc.num_beams; k++) {
+            beam_combine(&proc.beam_weights[k*num_chans], chan_buffs, start,
+                beam_buffs[k] + start, len);
+        }
+    }
+}
+
+/***********************************************************************
+ * rx processing chain
+ **********************************************************************/
+void process_rx_buffers(const rx_processing &proc,
+    const std::vector<std::complex<float>*> &buffs,
+    const std::vector<size_t> &channels,
+    size_t num_samps)
+{
+    for (size_t i = 0; i < buffs.size(); i++) {
+        if (channels[i] < proc.iq_cal.size()) {
+            apply_iq_correction(buffs[i], num_samps, proc.iq_cal[channels[i]]);
+        }
+    }
+}
+
+uint64_t max_chan_skip(const rx_processing &proc, const std::vector<size_t> &channels)
+{
+    uint64_t skip = 0;
+    for (size_t ch : channels) {
+        if (ch < proc.chan_skip.size()) {
+            skip = std::max(skip, proc.chan_skip[ch]);
+        }
+    }
+    return skip;
+}
+
+/***********************************************************************
+ * Delay estimation
+ **********************************************************************/
+void fft_radix2(std::vector<std::complex<double>> &data, bool inverse)
+{
+    const size_t n = data.size();
+    if (n & (n - 1)) {
+        throw std::invalid_argument("fft_radix2: length must be a power of two");
+    }
+    // Bit-reversal permutation
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[i], data[j]);
+        }
+    }
+    // Twiddles for the full length, each from cos/sin directly so the error
+    // doesn't build up along the table.  A pass of length len uses every
+    // (n/len)th entry.
+    const double sign = inverse ? 1.0 : -1.0;
+    std::vector<std::complex<double>> twiddle(n / 2);
+    for (size_t k = 0; k < n / 2; k++) {
+        const double angle = sign * 2.0 * M_PI * k / n;
+        twiddle[k] = std::complex<double>(std::cos(angle), std::sin(angle));
+    }
+    // Butterflies, doubling the transform length each pass
+    for (size_t len = 2; len <= n; len <<= 1) {
+        const size_t stride = n / len;
+        for (size_t start = 0; start < n; start += len) {
+            for (size_t k = 0; k < len / 2; k++) {
+                std::complex<double> even = data[start + k];
+                std::complex<double> odd = twiddle[k * stride] * data[start + k + len/2];
+                data[start + k] = even + odd;
+                data[start + k + len/2] = even - odd;
+            }
+        }
+    }
+}
+
+size_t find_delay(const std::vector<std::complex<float>> &ref,
+    const std::vector<std::complex<float>> &rx,
+    double *peak_ratio)
+{
+    if (ref.empty() || rx.size() < ref.size()) {
+        throw std::invalid_argument("find_delay: rx must be at least as long as ref");
+    }
+    // corr[k] = sum(rx[n+k] * conj(ref[n])) = ifft(fft(rx) .* conj(fft(ref))),
+    // with enough zero padding that the wanted lags don't wrap around
+    size_t nfft = 1;
+    while (nfft < rx.size() + ref.size()) {
+        nfft <<= 1;
+    }
+    std::vector<std::complex<double>> rx_f(nfft), ref_f(nfft);
+    std::copy(rx.begin(), rx.end(), rx_f.begin());
+    std::copy(ref.begin(), ref.end(), ref_f.begin());
+    fft_radix2(rx_f, false);
+    fft_radix2(ref_f, false);
+    for (size_t i = 0; i < nfft; i++) {
+        rx_f[i] *= std::conj(ref_f[i]);
+    }
+    fft_radix2(rx_f, true);
+    const size_t num_lags = rx.size() - ref.size() + 1;
+    size_t best = 0;
+    double best_mag = -1, total_mag = 0;
+    for (size_t k = 0; k < num_lags; k++) {
+        double mag = std::abs(rx_f[k]);
+        total_mag += mag;
+        if (mag > best_mag) {
+            best_mag = mag;
+            best = k;
+        }
+    }
+    if (peak_ratio != NULL) {
+        *peak_ratio = (total_mag > 0) ? best_mag * num_lags / total_mag : 0;
+    }
+    return best;
+}
+
@@ -0,0 +1,65 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//// Sample processing applied to the rx stream as it is received
+
+#pragma once
+
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+//! Per-channel IQ correction, y = gain * (z + imbalance * conj(z)) with
+//  z = x - dc_offset.  This is stored as the equivalent real 2x2 matrix
+//  acting on [re; im], which vectorizes without any complex arithmetic.
+struct iq_correction {
+    float dc_re, dc_im;
+    float m00, m01, m10, m11;
+};
+
+//! Processing applied to every buffer received.  iq_cal is indexed by device
+//  channel; channels without an entry are left alone.  If num_beams is
+//  nonzero, the corrected channels are then combined into num_beams beams
+//  using the row-major num_beams x num_channels matrix beam_weights.
+//  chan_skip, also by device channel, is the number of leading samples each
+//  channel drops before any are written, which lines up channels with
+//  different loopback delays (see recv_to_file).
+struct rx_processing {
+    std::vector<iq_correction> iq_cal;
+    size_t num_beams = 0;
+    std::vector<std::complex<float>> beam_weights;
+    std::vector<uint64_t> chan_skip;
+};
+
+//! Largest chan_skip of the given channels
+extern uint64_t max_chan_skip(const rx_processing &proc, const std::vector<size_t> &channels);
+
+extern iq_correction make_iq_correction(std::complex<double> dc_offset,
+    std::complex<double> gain,
+    std::complex<double> imbalance);
+
+extern void apply_iq_correction(std::complex<float> *buff, size_t num_samps, const iq_correction &corr);
+
+extern void process_rx_buffers(const rx_processing &proc,
+    const std::vector<std::complex<float>*> &buffs,
+    const std::vector<size_t> &channels,
+    size_t num_samps);
+
+extern void beamform(const rx_processing &proc,
+    const std::vector<std::complex<float>*> &chan_buffs,
+    const std::vector<std::complex<float>*> &beam_buffs,
+    size_t num_samps);
+
+//! In-place radix-2 FFT; the length must be a power of two.  The inverse
+//  transform is not scaled.
+extern void fft_radix2(std::vector<std::complex<double>> &data, bool inverse);
+
+//! Offset of ref within rx, from the peak magnitude of their cross-correlation.
+//  Only offsets where all of ref fits in rx are searched.  If peak_ratio is
+//  given, it is set to the peak over the mean correlation magnitude, as a
+//  measure of how clearly ref was found.
+extern size_t find_delay(const std::vector<std::complex<float>> &ref,
+    const std::vector<std::complex<float>> &rx,
+    double *peak_ratio = NULL);
+
@@ -5,6 +5,8 @@
 //
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "usrp_gpio.hpp"
+#include <chrono>
+#include <stdexcept>
 #include <unistd.h>
 
 // General definitions
@@ -23,6 +25,10 @@
 #define RX_BIT (0x001 << 2)
 #define ATR_MASK ( TRIGGER_BIT | TX_BIT | RX_BIT )
 
+// Pause between readbacks while waiting for an edge, so the wait doesn't
+// saturate the control link or spin a core
+#define GPIO_POLL_US 200
+
 void usrp_gpio_arm_trigger(uhd::usrp::multi_usrp::sptr usrp)
 {
     // Set bit to automatic control mode
@@ -83,3 +89,46 @@ void usrp_gpio_spi(uhd::usrp::multi_usrp::sptr usrp, uint8_t *pkt, size_t num_pk
     usrp->set_gpio_attr(GPIO_PANEL, "OUT", 0, MOSI_BITS);
     usrp->set_gpio_attr(GPIO_PANEL, "OUT", SS_BIT, SS_BIT); 
 }
+
+// Wait for a rising edge on FP0 pin bit, which is made an input while waiting
+// and then put back as it was.  The pin is polled over the control link, so
+// edge_time is only a lower bound: it is the device time just before the last
+// readback that saw the pin low, and can be early by one poll (GPIO_POLL_US
+// plus the round trips to read the time and the pin, typically well under a
+// millisecond).  Returns false on timeout.  The ATR pins used by the PA
+// trigger are refused.
+bool usrp_gpio_wait_edge(uhd::usrp::multi_usrp::sptr usrp, int bit, double timeout, uhd::time_spec_t &edge_time)
+{
+    if (bit < 0 || bit >= 32 || !((ALL_BITS >> bit) & 1)) {
+        throw std::invalid_argument("gpio bit must be between 0 and 11");
+    }
+    const uint32_t mask = 1u << bit;
+    if (mask & ATR_MASK) {
+        throw std::invalid_argument("gpio bit is used by the PA trigger");
+    }
+    const uint32_t old_ctrl = usrp->get_gpio_attr(GPIO_PANEL, "CTRL");
+    const uint32_t old_ddr = usrp->get_gpio_attr(GPIO_PANEL, "DDR");
+    // Manual control, input mode
+    usrp->set_gpio_attr(GPIO_PANEL, "CTRL", 0, mask);
+    usrp->set_gpio_attr(GPIO_PANEL, "DDR", 0, mask);
+
+    bool found = false;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+    uhd::time_spec_t last_time = usrp->get_time_now();
+    uint32_t last = usrp->get_gpio_attr(GPIO_PANEL, "READBACK") & mask;
+    while (!found && std::chrono::steady_clock::now() < deadline) {
+        usleep(GPIO_POLL_US);
+        uhd::time_spec_t this_time = usrp->get_time_now();
+        uint32_t val = usrp->get_gpio_attr(GPIO_PANEL, "READBACK") & mask;
+        if (val & ~last) {
+            edge_time = last_time;
+            found = true;
+        }
+        last = val;
+        last_time = this_time;
+    }
+
+    usrp->set_gpio_attr(GPIO_PANEL, "DDR", old_ddr, mask);
+    usrp->set_gpio_attr(GPIO_PANEL, "CTRL", old_ctrl, mask);
+    return found;
+}
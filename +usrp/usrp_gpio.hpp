@@ -13,3 +13,4 @@
 extern void usrp_gpio_arm_trigger(uhd::usrp::multi_usrp::sptr usrp);
 extern void usrp_gpio_disarm_trigger(uhd::usrp::multi_usrp::sptr usrp);
 extern void usrp_gpio_spi(uhd::usrp::multi_usrp::sptr usrp, uint8_t *pkt, size_t num_pkt);
+extern bool usrp_gpio_wait_edge(uhd::usrp::multi_usrp::sptr usrp, int bit, double timeout, uhd::time_spec_t &edge_time);
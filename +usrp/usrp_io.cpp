@@ -6,11 +6,20 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "usrp_io.hpp"
 #include <boost/filesystem.hpp>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <sstream>
 #include <uhd/utils/thread.hpp>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
-static bool stop_signal_called = false;
 static bool tx_underflowed = false;
+// Set by tx time errors and rx late command errors
+static std::atomic<bool> late_command(false);
 
 /***********************************************************************
  * Utilities
@@ -32,6 +41,16 @@ std::string generate_out_filename(
     return base_fn_fp.string();
 }
 
+//! Name of one segment of a rotated capture, e.g. usrp_samples.00.0003.dat
+std::string generate_segment_filename(
+    const std::string& base_fn, size_t this_name, uint64_t segment)
+{
+    boost::filesystem::path base_fn_fp(base_fn);
+    base_fn_fp.replace_extension(boost::filesystem::path(
+        str(boost::format("%02d.%04d%s") % this_name % segment % base_fn_fp.extension().string())));
+    return base_fn_fp.string();
+}
+
 //! Check if an underflow occurred, and clear the error variable
 bool check_clear_underflow() {
     bool val = tx_underflowed;
@@ -39,6 +58,117 @@ bool check_clear_underflow() {
     return val;
 }
 
+//! Check if a stream command or burst arrived late, and clear the flag
+bool check_clear_late_command() {
+    return late_command.exchange(false);
+}
+
+/***********************************************************************
+ * tx lead time
+ **********************************************************************/
+// Lead used before anything has been measured
+#define TX_LEAD_DEFAULT 0.005
+#define TX_LEAD_MIN 0.001
+#define TX_LEAD_MAX 1.0
+// Bursts remembered per setting
+#define TX_LEAD_HISTORY 16
+// Packets the transport queues ahead of the device by default (UHD's
+// num_send_frames); send only waits on the device once these are full
+#define TX_PREFILL_FRAMES 32
+
+//! Time from resetting the device clock to the start of the burst.  This is
+//  the slowest recent start-up with 50% headroom plus 0.5 ms, or longer if a
+//  recent burst was late.
+double choose_tx_lead(const tx_lead_stats& stats)
+{
+    double lead = TX_LEAD_DEFAULT;
+    if (!stats.overheads.empty()) {
+        double worst = *std::max_element(stats.overheads.begin(), stats.overheads.end());
+        lead = 1.5 * worst + 0.0005;
+    }
+    return std::min(TX_LEAD_MAX, std::max(TX_LEAD_MIN, std::max(lead, stats.floor)));
+}
+
+//! Record a burst that started lead seconds after the clock was reset and
+//  took overhead seconds to get going
+void update_tx_lead(tx_lead_stats& stats, double lead, double overhead, bool failed)
+{
+    stats.overheads.push_back(overhead);
+    if (stats.overheads.size() > TX_LEAD_HISTORY) {
+        stats.overheads.pop_front();
+    }
+    if (failed) {
+        stats.floor = std::min(TX_LEAD_MAX, 2 * lead);
+    } else {
+        stats.floor *= 0.9;
+    }
+}
+
+//! When a burst started lead seconds after time_zero was ready to go, or
+//  time_zero if nothing was sent.  That is once the tx buffers were filled,
+//  unless filling them ran past the start time: then send was waiting on the
+//  device rather than the host, and only the first send has to be early.
+std::chrono::steady_clock::time_point tx_ready_time(const tx_timing& timing,
+    std::chrono::steady_clock::time_point time_zero, double lead)
+{
+    if (!timing.sent) {
+        return time_zero;
+    }
+    auto start = time_zero + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(lead));
+    return (timing.prefilled <= start) ? timing.prefilled : timing.first_send;
+}
+
+//! Whether cpu can be given as a stream thread's core: -1 (any core), or
+//  one of the online cores that fits in a cpu_set_t
+bool valid_stream_cpu(int cpu)
+{
+    if (cpu == -1) {
+        return true;
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+    online = std::min<long>(online, CPU_SETSIZE);
+#endif
+    return cpu >= 0 && cpu < online;
+}
+
+//! Apply affinity and realtime scheduling to the calling thread
+void configure_stream_thread(const stream_thread_opts& opts)
+{
+#ifdef __linux__
+    // Split rx streamers offset the configured core, which can run past
+    // the last one
+    if (opts.cpu >= 0 && !valid_stream_cpu(opts.cpu)) {
+        std::cerr << "No cpu " << opts.cpu << "; not pinning thread" << std::endl;
+    } else if (opts.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(opts.cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err) {
+            std::cerr << "Failed to pin thread to cpu " << opts.cpu << ": "
+                      << strerror(err) << std::endl;
+        }
+    }
+    if (opts.rt_priority > 0) {
+        sched_param param;
+        param.sched_priority = opts.rt_priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (!err) {
+            return;
+        }
+        std::cerr << "Failed to set SCHED_FIFO priority " << opts.rt_priority << ": "
+                  << strerror(err) << std::endl;
+    }
+#else
+    if (opts.cpu >= 0 || opts.rt_priority > 0) {
+        std::cerr << "Thread affinity and priority are only supported on Linux" << std::endl;
+    }
+#endif
+    uhd::set_thread_priority_safe();
+}
+
 /*******************************************************
  * send_from_file
  ******************************************************/
@@ -47,10 +177,12 @@ void send_from_file(
     const std::string &file,
     size_t samps_per_buff,
     size_t num_channels,
-    uhd::tx_metadata_t md
+    uhd::tx_metadata_t md,
+    stream_thread_opts thread_opts,
+    tx_timing *timing
 ){
     // Give this thread realtime
-    uhd::set_thread_priority_safe();
+    configure_stream_thread(thread_opts);
 
     // Buffers
     std::vector<std::vector<std::complex<float>>> buffs(
@@ -73,10 +205,15 @@ void send_from_file(
     }
     UHD_ASSERT_THROW(infiles.size() == buffs.size());
 
+    // Start-up is done once the queued packets are full, or the whole burst
+    // has been sent
+    const size_t prefill_samps = tx_stream->get_max_num_samps() * TX_PREFILL_FRAMES;
+    size_t total_sent = 0;
+
     //loop until the entire file has been read
     size_t underflows = 0;
     auto start = std::chrono::system_clock::now();
-    while(not md.end_of_burst and not stop_signal_called){
+    while(not md.end_of_burst){
 
         // Fill all tx buffers
         size_t num_tx_samps;
@@ -97,14 +234,24 @@ void send_from_file(
             }
         }
         // Send all tx buffers
-        tx_stream->send(buff_ptrs, num_tx_samps, md);
+        total_sent += tx_stream->send(buff_ptrs, num_tx_samps, md);
+        if (timing != NULL && md.start_of_burst) {
+            timing->first_send = std::chrono::steady_clock::now();
+        }
+        if (timing != NULL && not timing->sent
+                and (total_sent >= prefill_samps or md.end_of_burst)) {
+            timing->prefilled = std::chrono::steady_clock::now();
+            timing->sent = true;
+        }
 
         // Check for async messages (underflow)
         uhd::async_metadata_t async_msg;
         if(tx_stream->recv_async_msg(async_msg)) {
             switch (async_msg.event_code) {
-                case uhd::async_metadata_t::EVENT_CODE_SEQ_ERROR:
                 case uhd::async_metadata_t::EVENT_CODE_TIME_ERROR:
+                    late_command = true;
+                    // fall through
+                case uhd::async_metadata_t::EVENT_CODE_SEQ_ERROR:
                     std::cout << "Sequence or time error" << std::endl;
                     break;
                 case uhd::async_metadata_t::EVENT_CODE_UNDERFLOW_IN_PACKET:
@@ -138,16 +285,195 @@ void send_from_file(
 /***********************************************************************
  * recv_to_file function
  **********************************************************************/
+/* Writes the received streams to one file per channel (or beam).  If
+ * segment_samps is nonzero, the output rotates to a new set of files every
+ * segment_samps samples, so no single file grows without bound.
+ */
 template <typename samp_type>
-void recv_to_file(uhd::usrp::multi_usrp::sptr usrp,
+class rx_file_writer
+{
+public:
+    rx_file_writer(const std::string& file,
+        const std::vector<size_t>& out_ids,
+        uint64_t segment_samps,
+        size_t samps_per_buff)
+        : file(file), out_ids(out_ids), segment_samps(segment_samps),
+          num_written(0), segment(0), zero_buff(samps_per_buff)
+    {
+        open_segment();
+    }
+
+    //! Append num_samps samples from each of ptrs, rotating files as needed
+    void write(const std::vector<samp_type*>& ptrs, size_t num_samps)
+    {
+        size_t done = 0;
+        while (done < num_samps) {
+            size_t len = num_samps - done;
+            if (segment_samps > 0) {
+                uint64_t room = segment_samps - num_written % segment_samps;
+                if (room == segment_samps && num_written > 0) {
+                    // Only start the next segment once there is data for it
+                    segment++;
+                    open_segment();
+                }
+                len = std::min<uint64_t>(len, room);
+            }
+            for (size_t i = 0; i < outfiles.size(); i++) {
+                outfiles[i]->write((const char*)(ptrs[i] + done), len * sizeof(samp_type));
+            }
+            num_written += len;
+            done += len;
+        }
+    }
+
+    //! Append num_samps zeros to every output
+    void write_zeros(uint64_t num_samps)
+    {
+        std::vector<samp_type*> zero_ptrs(outfiles.size(), &zero_buff.front());
+        while (num_samps > 0) {
+            size_t chunk = std::min<uint64_t>(num_samps, zero_buff.size());
+            write(zero_ptrs, chunk);
+            num_samps -= chunk;
+        }
+    }
+
+    void close()
+    {
+        for (size_t i = 0; i < outfiles.size(); i++) {
+            outfiles[i]->close();
+        }
+    }
+
+private:
+    void open_segment()
+    {
+        close();
+        outfiles.clear();
+        // (use shared_ptr because ofstream is non-copyable)
+        for (size_t i = 0; i < out_ids.size(); i++) {
+            // Name files by channel, so split streamers write disjoint sets of files
+            const std::string this_filename = (segment_samps > 0)
+                ? generate_segment_filename(file, out_ids[i], segment)
+                : generate_out_filename(file, out_ids.size(), out_ids[i]);
+            outfiles.push_back(boost::shared_ptr<std::ofstream>(
+                new std::ofstream(this_filename.c_str(), std::ofstream::binary)));
+            if (outfiles.back()->fail()) {
+                throw std::runtime_error("Failed to open " + this_filename + ": " + strerror(errno));
+            }
+        }
+    }
+
+    std::string file;
+    std::vector<size_t> out_ids;
+    uint64_t segment_samps;
+    uint64_t num_written;
+    uint64_t segment;
+    std::vector<samp_type> zero_buff;
+    std::vector<boost::shared_ptr<std::ofstream>> outfiles;
+};
+
+/* Lines up channels that drop different numbers of leading samples (see
+ * rx_processing::chan_skip).  Each channel queues here once its skip has been
+ * dropped, and samples come out in step once every channel has them, so the
+ * queues only ever hold the difference in skips plus a buffer.
+ */
+template <typename samp_type>
+class rx_aligner
+{
+public:
+    rx_aligner(const std::vector<uint64_t>& skip) : skip(skip), pending(skip.size()) {}
+
+    //! Queue num_samps stream samples of each channel; NULL ptrs queue zeros
+    void push(const std::vector<samp_type*>* ptrs, size_t num_samps)
+    {
+        for (size_t i = 0; i < pending.size(); i++) {
+            size_t drop = std::min<uint64_t>(skip[i], num_samps);
+            skip[i] -= drop;
+            if (ptrs) {
+                pending[i].insert(pending[i].end(), (*ptrs)[i] + drop, (*ptrs)[i] + num_samps);
+            } else {
+                pending[i].resize(pending[i].size() + num_samps - drop);
+            }
+        }
+    }
+
+    //! Move up to max_samps samples that every channel has into ptrs, and
+    //  return how many were moved
+    size_t pop(const std::vector<samp_type*>& ptrs, size_t max_samps)
+    {
+        size_t num_samps = max_samps;
+        for (size_t i = 0; i < pending.size(); i++) {
+            num_samps = std::min(num_samps, pending[i].size());
+        }
+        for (size_t i = 0; i < pending.size(); i++) {
+            std::copy(pending[i].begin(), pending[i].begin() + num_samps, ptrs[i]);
+            pending[i].erase(pending[i].begin(), pending[i].begin() + num_samps);
+        }
+        return num_samps;
+    }
+
+private:
+    std::vector<uint64_t> skip;
+    std::vector<std::vector<samp_type>> pending;
+};
+
+// A first packet further than this past the start time is taken to be stale
+// rather than the end of a (very long) drop
+#define RX_MAX_GAP_SECS 1.0
+
+/* Read and discard whatever a stopped stream still has in flight, so the next
+ * capture on this streamer doesn't start with old packets.  Stops at the end
+ * of the burst, or once nothing has arrived for 50 ms.
+ */
+void drain_rx_stream(uhd::rx_streamer::sptr rx_stream)
+{
+    const size_t spb = rx_stream->get_max_num_samps();
+    std::vector<std::vector<std::complex<float>>> buffs(
+        rx_stream->get_num_channels(), std::vector<std::complex<float>>(spb));
+    std::vector<void*> buff_ptrs;
+    for (size_t i = 0; i < buffs.size(); i++) {
+        buff_ptrs.push_back(&buffs[i].front());
+    }
+    uhd::rx_metadata_t md;
+    do {
+        rx_stream->recv(buff_ptrs, spb, md, 0.05);
+    } while (md.error_code != uhd::rx_metadata_t::ERROR_CODE_TIMEOUT and not md.end_of_burst);
+}
+
+/* Sort gaps by start and combine the ones that overlap or touch, e.g. the
+ * gaps of several streamers of one capture.
+ */
+void merge_gaps(std::vector<rx_gap>& gaps)
+{
+    std::sort(gaps.begin(), gaps.end(),
+        [](const rx_gap& a, const rx_gap& b) { return a.start < b.start; });
+    std::vector<rx_gap> merged;
+    for (const rx_gap& gap : gaps) {
+        if (!merged.empty() && gap.start <= merged.back().start + merged.back().length) {
+            uint64_t end = std::max(merged.back().start + merged.back().length, gap.start + gap.length);
+            merged.back().length = end - merged.back().start;
+        } else {
+            merged.push_back(gap);
+        }
+    }
+    gaps = merged;
+}
+
+template <typename samp_type>
+rx_result recv_to_file(uhd::usrp::multi_usrp::sptr usrp,
     uhd::rx_streamer::sptr rx_stream,
     const std::string& file,
     size_t samps_per_buff,
-    int num_requested_samples,
-    double settling_time,
-    std::vector<size_t> rx_channel_nums)
+    uint64_t num_requested_samples,
+    double start_time,
+    std::vector<size_t> rx_channel_nums,
+    const rx_processing& proc,
+    uint64_t segment_samps,
+    const std::atomic<bool> *stop)
 {
-    int num_total_samps = 0;
+    // num_samps counts every sample written, including zeros filled into gaps
+    rx_result result;
+    result.num_samps = 0;
 
     // Prepare buffers for received samples and metadata
     uhd::rx_metadata_t md;
@@ -159,74 +485,392 @@ void recv_to_file(uhd::usrp::multi_usrp::sptr usrp,
         buff_ptrs.push_back(&buffs[i].front());
     }
 
-    // Create one ofstream object per channel
-    // (use shared_ptr because ofstream is non-copyable)
-    std::vector<boost::shared_ptr<std::ofstream>> outfiles;
-    for (size_t i = 0; i < buffs.size(); i++) {
-        const std::string this_filename = generate_out_filename(file, buffs.size(), i);
-        outfiles.push_back(boost::shared_ptr<std::ofstream>(
-            new std::ofstream(this_filename.c_str(), std::ofstream::binary)));
+    // When beamforming, the files hold beams rather than channels
+    std::vector<size_t> out_ids = rx_channel_nums;
+    std::vector<std::vector<samp_type>> beam_buffs;
+    std::vector<samp_type*> beam_ptrs;
+    if (proc.num_beams > 0) {
+        UHD_ASSERT_THROW(proc.beam_weights.size() == proc.num_beams * buffs.size());
+        out_ids.clear();
+        beam_buffs.resize(proc.num_beams, std::vector<samp_type>(samps_per_buff));
+        for (size_t k = 0; k < proc.num_beams; k++) {
+            out_ids.push_back(k);
+            beam_ptrs.push_back(&beam_buffs[k].front());
+        }
     }
-    UHD_ASSERT_THROW(outfiles.size() == buffs.size());
+
+    // One output file per channel (or beam), rotated every segment_samps
+    rx_file_writer<samp_type> writer(file, out_ids, segment_samps, samps_per_buff);
+    result.outputs = out_ids;
     UHD_ASSERT_THROW(buffs.size() == rx_channel_nums.size());
+
+    // Each channel drops its own chan_skip leading samples, so the stream has
+    // to run max_skip past the requested length (usrp_rx_start asks for that)
+    std::vector<uint64_t> skip;
+    for (size_t ch : rx_channel_nums) {
+        skip.push_back(ch < proc.chan_skip.size() ? proc.chan_skip[ch] : 0);
+    }
+    const uint64_t max_skip = *std::max_element(skip.begin(), skip.end());
+    const uint64_t min_skip = *std::min_element(skip.begin(), skip.end());
+    rx_aligner<samp_type> aligner(skip);
+    // Lined-up samples come out here, as buff_ptrs may still hold a packet
+    std::vector<std::vector<samp_type>> aligned_buffs;
+    std::vector<samp_type*> aligned_ptrs;
+    if (max_skip > 0) {
+        aligned_buffs.resize(buffs.size(), std::vector<samp_type>(samps_per_buff));
+        for (size_t i = 0; i < aligned_buffs.size(); i++) {
+            aligned_ptrs.push_back(&aligned_buffs[i].front());
+        }
+    }
     bool overflow_message = true;
+    bool overflowed = false;
     double timeout =
-        settling_time + 0.1f; // expected settling time + padding for first recv
-
-    while (not stop_signal_called
-           and (num_requested_samples > num_total_samps or num_requested_samples == 0)) {
-        size_t num_rx_samps = rx_stream->recv(buff_ptrs, samps_per_buff, md, timeout);
-        timeout             = 0.1f; // small timeout for subsequent recv
-
-        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT) {
-            std::cout << boost::format("Timeout while streaming") << std::endl;
-            break;
-        }
-        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW) {
-            if (overflow_message) {
-                overflow_message = false;
-                std::cerr
-                    << boost::format(
-                           "Got an overflow indication. Please consider the following:\n"
-                           "  Your write medium must sustain a rate of %fMB/s.\n"
-                           "  Dropped samples will not be written to the file.\n"
-                           "  Please modify this example for your purposes.\n"
-                           "  This message will not appear again.\n")
-                           % (usrp->get_rx_rate() * sizeof(samp_type) / 1e6);
-            }
-            continue;
+        start_time + 0.1f; // expected settling time + padding for first recv
+    // Packet timestamps are converted to sample indices relative to the
+    // commanded start time
+    const double rate = usrp->get_rx_rate();
+    const long long start_ticks = uhd::time_spec_t(start_time).to_ticks(rate);
+    const uint64_t num_requested = num_requested_samples;
+    const uint64_t num_stream = (num_requested == 0) ? 0 : num_requested + max_skip;
+    // Samples received (or filled) so far, which is also the sample index we
+    // expect the next packet to start at
+    uint64_t stream_samps = 0;
+    const long long max_gap = (long long) (rate * RX_MAX_GAP_SECS);
+    bool stale_message = true;
+    bool first_packet = true;
+    // Streams that don't end by themselves (see usrp_rx_start) have to be
+    // stopped and drained; so does a burst we leave early
+    const bool continuous = num_stream == 0 or num_stream > RX_MAX_BURST_SAMPS;
+
+    // Beamform and write out num_samps samples from chan_ptrs
+    auto write_out = [&](const std::vector<samp_type*>& chan_ptrs, size_t num_samps) {
+        if (proc.num_beams > 0) {
+            beamform(proc, chan_ptrs, beam_ptrs, num_samps);
+        }
+        writer.write((proc.num_beams > 0) ? beam_ptrs : chan_ptrs, num_samps);
+        result.num_samps += num_samps;
+    };
+    // Write out whatever the aligner has for every channel
+    auto write_aligned = [&]() {
+        size_t len;
+        while ((len = aligner.pop(aligned_ptrs, samps_per_buff)) > 0) {
+            write_out(aligned_ptrs, len);
+        }
+    };
+    // Fill num_samps dropped stream samples with zeros, and record where they
+    // land in the output: a gap covers the samples missing on any channel
+    auto fill_gap = [&](uint64_t num_samps) {
+        uint64_t gap_start = (stream_samps > max_skip) ? stream_samps - max_skip : 0;
+        uint64_t gap_end = stream_samps + num_samps - min_skip;
+        if (num_requested != 0) {
+            gap_end = std::min(gap_end, num_requested);
         }
-        if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
-            throw std::runtime_error(
-                str(boost::format("Receiver error %s") % md.strerror()));
+        if (gap_end > gap_start) {
+            result.gaps.push_back(rx_gap{gap_start, gap_end - gap_start});
         }
+        stream_samps += num_samps;
+        if (max_skip == 0) {
+            writer.write_zeros(num_samps);
+            result.num_samps += num_samps;
+            return;
+        }
+        while (num_samps > 0) {
+            size_t chunk = std::min<uint64_t>(num_samps, samps_per_buff);
+            aligner.push(NULL, chunk);
+            write_aligned();
+            num_samps -= chunk;
+        }
+    };
 
-        num_total_samps += num_rx_samps;
+    try {
+        while ((stop == NULL or not *stop)
+               and (num_stream > stream_samps or num_stream == 0)) {
+            size_t num_rx_samps = rx_stream->recv(buff_ptrs, samps_per_buff, md, timeout);
+            timeout             = 0.1f; // small timeout for subsequent recv
 
-        for (size_t i = 0; i < outfiles.size(); i++) {
-            outfiles[i]->write(
-                (const char*)buff_ptrs[i], num_rx_samps * sizeof(samp_type));
+            if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT) {
+                std::cout << boost::format("Timeout while streaming") << std::endl;
+                // After an overflow the device may end the burst early, so pad
+                // out the rest of the capture rather than returning a short file
+                if (overflowed and num_stream > stream_samps) {
+                    fill_gap(num_stream - stream_samps);
+                }
+                break;
+            }
+            if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW) {
+                overflowed = true;
+                if (overflow_message) {
+                    overflow_message = false;
+                    std::cerr
+                        << boost::format(
+                               "Got an overflow indication. Please consider the following:\n"
+                               "  Your write medium must sustain a rate of %fMB/s.\n"
+                               "  Dropped samples will be replaced with zeros.\n"
+                               "  This message will not appear again.\n")
+                               % (rate * sizeof(samp_type) / 1e6);
+                }
+                continue;
+            }
+            if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_LATE_COMMAND) {
+                late_command = true;
+            }
+            if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
+                throw std::runtime_error(
+                    str(boost::format("Receiver error %s") % md.strerror()));
+            }
+
+            // Fill any samples dropped before this packet with zeros, so that
+            // everything after a drop stays time-aligned
+            if (md.has_time_spec) {
+                long long pkt_idx = md.time_spec.to_ticks(rate) - start_ticks;
+                // Packets from before this capture started, e.g. left over from
+                // a stream on an earlier time base, can't be placed.  After the
+                // first packet, a jump ahead is a real drop, however long.
+                if (pkt_idx < 0 or (first_packet and pkt_idx > max_gap)) {
+                    if (stale_message) {
+                        stale_message = false;
+                        std::cerr << "Discarding packets with stale timestamps" << std::endl;
+                    }
+                    continue;
+                }
+                if (pkt_idx > (long long) stream_samps) {
+                    uint64_t missing = pkt_idx - stream_samps;
+                    if (num_stream != 0) {
+                        missing = std::min(missing, num_stream - stream_samps);
+                    }
+                    fill_gap(missing);
+                }
+            }
+            first_packet = false;
+
+            if (num_stream != 0) {
+                num_rx_samps = std::min<uint64_t>(num_rx_samps, num_stream - stream_samps);
+            }
+            stream_samps += num_rx_samps;
+
+            // Correct the samples in place before they are written out
+            // (only instantiated for fc32, which is all the processing supports)
+            process_rx_buffers(proc, buff_ptrs, rx_channel_nums, num_rx_samps);
+            if (max_skip > 0) {
+                aligner.push(&buff_ptrs, num_rx_samps);
+                write_aligned();
+            } else {
+                write_out(buff_ptrs, num_rx_samps);
+            }
         }
+    } catch (...) {
+        // Leave the streamer idle for the next capture
+        rx_stream->issue_stream_cmd(uhd::stream_cmd_t(uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS));
+        drain_rx_stream(rx_stream);
+        throw;
+    }
+
+    // Shut down receiver.  A burst that ran to completion has already ended,
+    // and draining it would only wait out the timeout.
+    bool stopped_early = num_stream > stream_samps;
+    if (continuous or stopped_early or overflowed) {
+        uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
+        rx_stream->issue_stream_cmd(stream_cmd);
+        drain_rx_stream(rx_stream);
     }
 
-    // Shut down receiver
-    uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE);
-    stream_cmd.stream_mode = uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS;
-    rx_stream->issue_stream_cmd(stream_cmd);
+    writer.close();
 
-    // Close files
-    for (size_t i = 0; i < outfiles.size(); i++) {
-        outfiles[i]->close();
+    if (not result.gaps.empty()) {
+        std::cout << "Warning: " << result.gaps.size()
+                  << " gaps were filled with zeros" << std::endl;
     }
+    return result;
 }
 
-void recv_to_file_fc(uhd::usrp::multi_usrp::sptr usrp,
+rx_result recv_to_file_fc(uhd::usrp::multi_usrp::sptr usrp,
+    uhd::rx_streamer::sptr rx_stream,
+    const std::string& file,
+    size_t samps_per_buff,
+    uint64_t num_requested_samples,
+    double start_time,
+    std::vector<size_t> rx_channel_nums,
+    const rx_processing& proc,
+    uint64_t segment_samps,
+    const std::atomic<bool> *stop) {
+        return recv_to_file<std::complex<float>> (usrp,rx_stream,file,samps_per_buff,num_requested_samples,start_time,rx_channel_nums,proc,segment_samps,stop);
+}
+
+/***********************************************************************
+ * Receive threads
+ **********************************************************************/
+//! Start recv_to_file_fc on a new thread with the given scheduling.  The
+//  sample buffers are allocated on that thread, so once it is pinned they are
+//  first touched (and therefore placed) on the pinned core's NUMA node.
+void start_recv_thread(rx_thread_job& job,
+    const stream_thread_opts& thread_opts,
+    uhd::usrp::multi_usrp::sptr usrp,
     uhd::rx_streamer::sptr rx_stream,
     const std::string& file,
     size_t samps_per_buff,
-    int num_requested_samples,
-    double settling_time,
-    std::vector<size_t> rx_channel_nums) {
-        recv_to_file<std::complex<float>> (usrp,rx_stream,file,samps_per_buff,num_requested_samples,settling_time,rx_channel_nums);
-        std::cout << "END-3\n";
+    uint64_t num_requested_samples,
+    double start_time,
+    std::vector<size_t> rx_channel_nums,
+    const rx_processing& proc,
+    uint64_t segment_samps)
+{
+    job.error = nullptr;
+    job.stop = false;
+    job.thread = boost::thread([=, &job]() {
+        try {
+            configure_stream_thread(thread_opts);
+            job.result = recv_to_file_fc(usrp, rx_stream, file, samps_per_buff,
+                num_requested_samples, start_time, rx_channel_nums, proc, segment_samps, &job.stop);
+        } catch (...) {
+            job.error = std::current_exception();
+        }
+    });
+}
+
+//! Wait for a receive thread, rethrowing any exception it raised
+rx_result finish_recv_thread(rx_thread_job& job)
+{
+    job.thread.join();
+    if (job.error) {
+        std::rethrow_exception(job.error);
+    }
+    return job.result;
+}
+
+/***********************************************************************
+ * Capture manifest
+ **********************************************************************/
+//! Path of the manifest for a capture to file, e.g. usrp_samples.manifest
+std::string generate_manifest_filename(const std::string& base_fn)
+{
+    boost::filesystem::path base_fn_fp(base_fn);
+    base_fn_fp.replace_extension(".manifest");
+    return base_fn_fp.string();
+}
+
+/* Write a text manifest listing every file of a capture, with the range of
+ * samples each one holds, followed by the gap map.  Returns its path.
+ */
+std::string write_rx_manifest(const std::string& file,
+    double rate,
+    uint64_t segment_samps,
+    const rx_result& result)
+{
+    const std::string manifest_filename = generate_manifest_filename(file);
+    std::ofstream manifest(manifest_filename.c_str());
+    manifest << "# n310-matlab rx capture" << std::endl;
+    manifest << boost::format("rate %.17g") % rate << std::endl;
+    manifest << "num_samps " << result.num_samps << std::endl;
+    manifest << "segment_samps " << segment_samps << std::endl;
+    manifest << "# file <output> <segment> <first sample> <num samples> <path>" << std::endl;
+    uint64_t seg_len = (segment_samps > 0) ? segment_samps : result.num_samps;
+    for (size_t out : result.outputs) {
+        uint64_t first = 0;
+        uint64_t segment = 0;
+        do {
+            uint64_t len = std::min(seg_len, result.num_samps - first);
+            const std::string this_filename = (segment_samps > 0)
+                ? generate_segment_filename(file, out, segment)
+                : generate_out_filename(file, result.outputs.size(), out);
+            manifest << "file " << out << " " << segment << " " << first << " " << len
+                     << " " << this_filename << std::endl;
+            first += len;
+            segment++;
+        } while (first < result.num_samps);
+    }
+    manifest << "# gap <start> <length>" << std::endl;
+    for (const rx_gap& gap : result.gaps) {
+        manifest << "gap " << gap.start << " " << gap.length << std::endl;
+    }
+    manifest.close();
+    if (manifest.fail()) {
+        throw std::runtime_error("Failed to write " + manifest_filename);
+    }
+    return manifest_filename;
+}
+
+//! Read up to max_samps fc32 samples from a file written by us or by Matlab
+std::vector<std::complex<float>> read_sample_file(const std::string& file, size_t max_samps)
+{
+    std::ifstream infile(file.c_str(), std::ifstream::binary);
+    if (infile.fail()) {
+        throw std::runtime_error("Failed to open " + file);
+    }
+    std::vector<std::complex<float>> samps(max_samps);
+    infile.read((char*) samps.data(), max_samps * sizeof(std::complex<float>));
+    samps.resize(infile.gcount() / sizeof(std::complex<float>));
+    return samps;
+}
+
+/* Loopback delays are cached in $XDG_CACHE_HOME/n310-matlab/delay_cal.txt,
+ * one "<rate> <fc> <delay ch0> <delay ch1> ..." line per setting, so they
+ * survive between sessions.
+ */
+static boost::filesystem::path delay_cal_filename()
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    boost::filesystem::path dir;
+    if (cache && *cache) {
+        dir = cache;
+    } else {
+        const char *home = getenv("HOME");
+        dir = boost::filesystem::path(home ? home : "/tmp") / ".cache";
+    }
+    return dir / "n310-matlab" / "delay_cal.txt";
+}
+
+//! Look up cached delays for this rate and center frequency
+bool load_delay_cal(double rate, double fc, std::vector<uint64_t>& delays)
+{
+    std::ifstream cal(delay_cal_filename().string().c_str());
+    std::string line;
+    while (std::getline(cal, line)) {
+        std::istringstream fields(line);
+        double line_rate, line_fc;
+        if (!(fields >> line_rate >> line_fc) || line_rate != rate || line_fc != fc) {
+            continue;
+        }
+        delays.clear();
+        uint64_t delay;
+        while (fields >> delay) {
+            delays.push_back(delay);
+        }
+        return !delays.empty();
+    }
+    return false;
 }
+
+//! Add or replace the cached delays for this rate and center frequency
+void save_delay_cal(double rate, double fc, const std::vector<uint64_t>& delays)
+{
+    const boost::filesystem::path cal_path = delay_cal_filename();
+    boost::filesystem::create_directories(cal_path.parent_path());
+    // Keep the entries for other settings
+    std::vector<std::string> lines;
+    {
+        std::ifstream cal(cal_path.string().c_str());
+        std::string line;
+        while (std::getline(cal, line)) {
+            std::istringstream fields(line);
+            double line_rate, line_fc;
+            if ((fields >> line_rate >> line_fc) && line_rate == rate && line_fc == fc) {
+                continue;
+            }
+            lines.push_back(line);
+        }
+    }
+    std::string entry = str(boost::format("%.17g %.17g") % rate % fc);
+    for (uint64_t delay : delays) {
+        entry += " " + std::to_string(delay);
+    }
+    lines.push_back(entry);
+    std::ofstream cal(cal_path.string().c_str());
+    for (const std::string& line : lines) {
+        cal << line << std::endl;
+    }
+    cal.close();
+    if (cal.fail()) {
+        throw std::runtime_error("Failed to write " + cal_path.string());
+    }
+}
+
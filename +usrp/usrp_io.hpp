@@ -9,20 +9,134 @@
 #pragma once
 
 #include <uhd/usrp/multi_usrp.hpp>
+#include "usrp_dsp.hpp"
+#include <boost/thread/thread.hpp>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
 
-extern void recv_to_file_fc(uhd::usrp::multi_usrp::sptr usrp,
+// Largest burst the radio can count in a single stream command (28 bits).
+// Longer captures stream continuously until recv_to_file stops them.
+#define RX_MAX_BURST_SAMPS 0x0FFFFFFFull
+
+//! A run of samples that were dropped by the device and filled with zeros.
+//  start is the sample index within the capture.  Every output of a streamer
+//  loses the same samples, so one entry covers all of them.
+struct rx_gap {
+    uint64_t start;
+    uint64_t length;
+};
+
+//! Result of a capture: samples written per output, the outputs (channels or
+//  beams) written, and any filled gaps
+struct rx_result {
+    uint64_t num_samps;
+    std::vector<size_t> outputs;
+    std::vector<rx_gap> gaps;
+};
+
+//! Scheduling for a streaming thread.  cpu is the core to pin the thread to
+//  (-1 to leave affinity alone).  rt_priority is a SCHED_FIFO priority from
+//  1-99, or 0 to use UHD's default realtime priority.
+struct stream_thread_opts {
+    int cpu = -1;
+    int rt_priority = 0;
+};
+
+//! Filled in by send_from_file: when the first buffer of the burst had been
+//  handed to the device, and when the tx buffers had been filled (or the
+//  whole burst sent, if it is shorter).  See tx_ready_time.
+struct tx_timing {
+    bool sent = false;
+    std::chrono::steady_clock::time_point first_send;
+    std::chrono::steady_clock::time_point prefilled;
+};
+
+//! How long recent bursts took to get going (seconds from resetting the
+//  device time until the tx buffers were filled), for one combination of
+//  rate, channel count and buffer size.  floor is raised when a burst is late
+//  or underflows, and relaxes again over successful bursts.
+struct tx_lead_stats {
+    std::deque<double> overheads;
+    double floor = 0;
+};
+
+//! A receive running on its own thread; see start_recv_thread.  Setting
+//  stop ends it after its current buffer.
+struct rx_thread_job {
+    rx_result result;
+    std::exception_ptr error;
+    std::atomic<bool> stop{false};
+    boost::thread thread;
+};
+
+extern std::string generate_out_filename(
+    const std::string& base_fn, size_t n_names, size_t this_name);
+
+extern std::string generate_segment_filename(
+    const std::string& base_fn, size_t this_name, uint64_t segment);
+
+extern std::string write_rx_manifest(const std::string& file,
+    double rate,
+    uint64_t segment_samps,
+    const rx_result& result);
+
+extern std::vector<std::complex<float>> read_sample_file(const std::string& file, size_t max_samps);
+
+extern bool load_delay_cal(double rate, double fc, std::vector<uint64_t>& delays);
+
+extern void save_delay_cal(double rate, double fc, const std::vector<uint64_t>& delays);
+
+extern bool valid_stream_cpu(int cpu);
+
+extern void configure_stream_thread(const stream_thread_opts& opts);
+
+extern void merge_gaps(std::vector<rx_gap>& gaps);
+
+extern void drain_rx_stream(uhd::rx_streamer::sptr rx_stream);
+
+extern rx_result recv_to_file_fc(uhd::usrp::multi_usrp::sptr usrp,
     uhd::rx_streamer::sptr rx_stream,
     const std::string& file,
     size_t samps_per_buff,
-    int num_requested_samples,
-    double settling_time,
-    std::vector<size_t> rx_channel_nums);
+    uint64_t num_requested_samples,
+    double start_time,
+    std::vector<size_t> rx_channel_nums,
+    const rx_processing& proc,
+    uint64_t segment_samps,
+    const std::atomic<bool> *stop);
+
+extern void start_recv_thread(rx_thread_job& job,
+    const stream_thread_opts& thread_opts,
+    uhd::usrp::multi_usrp::sptr usrp,
+    uhd::rx_streamer::sptr rx_stream,
+    const std::string& file,
+    size_t samps_per_buff,
+    uint64_t num_requested_samples,
+    double start_time,
+    std::vector<size_t> rx_channel_nums,
+    const rx_processing& proc,
+    uint64_t segment_samps);
+
+extern rx_result finish_recv_thread(rx_thread_job& job);
 
 extern void send_from_file(
     uhd::tx_streamer::sptr tx_stream,
     const std::string &file,
     size_t samps_per_buff,
     size_t num_channels,
-    uhd::tx_metadata_t md);
+    uhd::tx_metadata_t md,
+    stream_thread_opts thread_opts,
+    tx_timing *timing);
 
 extern bool check_clear_underflow();
+
+extern bool check_clear_late_command();
+
+extern double choose_tx_lead(const tx_lead_stats& stats);
+
+extern void update_tx_lead(tx_lead_stats& stats, double lead, double overhead, bool failed);
+
+extern std::chrono::steady_clock::time_point tx_ready_time(const tx_timing& timing,
+    std::chrono::steady_clock::time_point time_zero, double lead);
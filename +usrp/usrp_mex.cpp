@@ -19,19 +19,170 @@
 #include <fstream>
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <list>
 #include "usrp_mex_util.hpp"
 #include "usrp_gpio.hpp"
 #include "usrp_io.hpp"
 
-void usrp_rx_start(uhd::rx_streamer::sptr stream, size_t num_samps, double start_time)
+void usrp_rx_start(uhd::rx_streamer::sptr stream, uint64_t num_samps, double start_time)
 {
     uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_NUM_SAMPS_AND_DONE);
+    // Longer (or unlimited) captures stream continuously, and recv_to_file
+    // stops the stream once it has enough samples
+    if (num_samps == 0 || num_samps > RX_MAX_BURST_SAMPS) {
+        stream_cmd.stream_mode = uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS;
+        num_samps = 0;
+    }
     stream_cmd.num_samps = num_samps;
     stream_cmd.time_spec = uhd::time_spec_t(start_time);
     stream_cmd.stream_now = false;
     stream->issue_stream_cmd(stream_cmd);
 }
 
+/* Read a sample count, which may be a double or a uint64 scalar.  Doubles are
+ * exact up to 2^53, which is over two years at 125 Msps.
+ */
+uint64_t get_count(const mxArray *arr, const char *what)
+{
+    if (!mxIsScalar(arr) || mxIsComplex(arr))
+        mexErrMsgTxt((std::string(what) + " must be a real scalar").c_str());
+    if (mxGetClassID(arr) == mxUINT64_CLASS)
+        return *((uint64_t *)mxGetData(arr));
+    double val = mxGetScalar(arr);
+    if (val < 0 || val != std::floor(val))
+        mexErrMsgTxt((std::string(what) + " must be a non-negative integer").c_str());
+    return (uint64_t) val;
+}
+
+/* Convert a gap map to a Matlab matrix with one [start, length] row per gap.
+ * Sample indices are zero-based.
+ */
+mxArray *gaps_to_mat(const std::vector<rx_gap>& gaps)
+{
+    mxArray *out = mxCreateDoubleMatrix(gaps.size(), 2, mxREAL);
+    double *data = mxGetDoubles(out);
+    for (size_t ii = 0; ii < gaps.size(); ii++) {
+        data[ii] = gaps[ii].start;
+        data[ii + gaps.size()] = gaps[ii].length;
+    }
+    return out;
+}
+
+/* Row vector of the outputs (channels, or beams when beamforming) a capture
+ * wrote, zero-based like the file names.
+ */
+mxArray *outputs_to_mat(const std::vector<size_t>& outputs)
+{
+    mxArray *out = mxCreateDoubleMatrix(1, outputs.size(), mxREAL);
+    std::copy(outputs.begin(), outputs.end(), mxGetDoubles(out));
+    return out;
+}
+
+/* Number of rx channels the session streams, over all of its streamers */
+size_t session_rx_channels(usrp_access inst)
+{
+    if (inst.stream_rx_groups.empty()) {
+        return inst.stream_rx ? inst.stream_rx->get_num_channels() : 0;
+    }
+    size_t session_chans = 0;
+    for (auto& group : inst.rx_group_chans) {
+        session_chans += group.size();
+    }
+    return session_chans;
+}
+
+/* Start receiving num_samps samples on chans at start_time, processed with
+ * proc.  If the session splits its channels across several streamers, each
+ * streamer gets its own stream command and thread; the threads all align
+ * their output to start_time using the packet timestamps.  Consecutive groups
+ * are pinned to consecutive cores, starting at the session's rx cpu.
+ */
+void start_rx(usrp_access inst, std::list<rx_thread_job>& jobs, const std::string& basepath,
+    uint64_t num_samps, double start_time, const std::vector<size_t>& chans, uint64_t segment_samps,
+    const rx_processing& proc)
+{
+    // Channels that drop leading samples need the stream to run that much
+    // longer to fill the request
+    if (inst.stream_rx_groups.empty()) {
+        uint64_t stream_samps = (num_samps == 0) ? 0 : num_samps + max_chan_skip(proc, chans);
+        usrp_rx_start(inst.stream_rx, stream_samps, start_time);
+        auto spb = inst.stream_rx->get_max_num_samps() * 10;
+        jobs.emplace_back();
+        start_recv_thread(jobs.back(), inst.session->rx_thread, inst.usrp_rx, inst.stream_rx,
+            basepath, spb, num_samps, start_time, chans, proc, segment_samps);
+        return;
+    }
+    if (proc.num_beams > 0) {
+        mexErrMsgTxt("rx: beamforming needs every channel on one rx streamer");
+    }
+    // Only complete groups can be streamed
+    if (chans.size() != session_rx_channels(inst)) {
+        mexErrMsgTxt("rx: channel count must match the session when rx streamers are split");
+    }
+    for (size_t g = 0; g < inst.stream_rx_groups.size(); g++) {
+        uint64_t stream_samps = (num_samps == 0) ? 0 : num_samps + max_chan_skip(proc, inst.rx_group_chans[g]);
+        usrp_rx_start(inst.stream_rx_groups[g], stream_samps, start_time);
+    }
+    for (size_t g = 0; g < inst.stream_rx_groups.size(); g++) {
+        stream_thread_opts opts = inst.session->rx_thread;
+        if (opts.cpu >= 0) {
+            opts.cpu += g;
+        }
+        auto spb = inst.stream_rx_groups[g]->get_max_num_samps() * 10;
+        jobs.emplace_back();
+        start_recv_thread(jobs.back(), opts, inst.usrp_rx, inst.stream_rx_groups[g],
+            basepath, spb, num_samps, start_time, inst.rx_group_chans[g], proc, segment_samps);
+    }
+}
+
+/* Wait for every receive thread started by start_rx and merge their results.
+ * Errors are raised, unless err_out is given to hold them.
+ */
+rx_result finish_rx(std::list<rx_thread_job>& jobs, std::string *err_out = NULL)
+{
+    rx_result result;
+    result.num_samps = 0;
+    std::string err;
+    bool first = true;
+    for (auto& job : jobs) {
+        try {
+            rx_result job_result = finish_recv_thread(job);
+            result.num_samps = first ? job_result.num_samps : std::min(result.num_samps, job_result.num_samps);
+            result.outputs.insert(result.outputs.end(), job_result.outputs.begin(), job_result.outputs.end());
+            result.gaps.insert(result.gaps.end(), job_result.gaps.begin(), job_result.gaps.end());
+            first = false;
+        } catch (const std::exception& e) {
+            err = e.what();
+        }
+    }
+    jobs.clear();
+    // Split streamers report their own drops; a sample is a gap if any
+    // streamer lost it
+    merge_gaps(result.gaps);
+    if (err_out != NULL) {
+        *err_out = err;
+    } else if (!err.empty()) {
+        mexErrMsgTxt(err.c_str());
+    }
+    return result;
+}
+
+/* The ring capture and background file captures stream on the rx streamer
+ * with a fixed device time reference, so nothing else may stream or reset
+ * the time while they run.  ring_ok allows a running ring, for commands that
+ * restart it.
+ */
+void check_rx_idle(usrp_access inst, const char *cmd, bool ring_ok = false)
+{
+    if (!ring_ok && inst.streams->ring && inst.streams->ring->running()) {
+        mexErrMsgTxt((std::string(cmd) + ": stop the ring capture first").c_str());
+    }
+    if (!inst.streams->rx_file_jobs.empty()) {
+        mexErrMsgTxt((std::string(cmd) + ": stop the file capture first").c_str());
+    }
+}
+
 /* Global variable containing pointers to everything important
  * the idea is that instantiating the Matlab class will just grab a new pointer
  * to the USRP connection.  Hopefully, no one is trying to use more than one 
@@ -47,8 +198,8 @@ void new_sub(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     // Check parameters
     if (nlhs != 1)
         mexErrMsgTxt("new: One output expected");
-    if (nrhs != 7 && nrhs != 8)
-        mexErrMsgTxt("new: 7-8 inputs expected");
+    if (nrhs < 6 || nrhs > 8)
+        mexErrMsgTxt("new: 6-8 inputs expected");
     // Start getting parameters
     if(!mxIsScalar(prhs[1]) || mxIsComplex(prhs[1]))
         mexErrMsgTxt("new: num_channels parameter must be scalar");
@@ -67,13 +218,24 @@ void new_sub(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     double tx_gain = mxGetScalar(prhs[5]);
     // usrp address is optional
     std::string addr;
-    if(nrhs == 7) {
+    if(nrhs >= 7) {
         if(!mxIsChar(prhs[6]))
             mexErrMsgTxt("new: addr must be string");
         addr = std::string(mxArrayToString(prhs[6]));
     } else {
         addr="";
     }
+    // Number of channels per rx streamer is optional; 0 puts every channel
+    // on one streamer
+    size_t rx_group_size = 0;
+    if(nrhs == 8) {
+        if(!mxIsScalar(prhs[7]) || mxIsComplex(prhs[7]))
+            mexErrMsgTxt("new: rx channels per streamer must be scalar");
+        rx_group_size = (size_t) mxGetScalar(prhs[7]);
+    }
+    if (rx_group_size >= num_channels) {
+        rx_group_size = 0;
+    }
     // Check if there's already an existing instance in the global
     bool existing_inst = ( global_usrp != NULL ) ? true : false;
     // Connect
@@ -123,7 +285,25 @@ void new_sub(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     uhd::stream_args_t stream_args("fc32", "sc16");
     stream_args.channels = channel_nums;
     uhd::tx_streamer::sptr tx_stream = (existing_inst) ? global_usrp->stream_tx : tx_usrp->get_tx_stream(stream_args);
-    uhd::rx_streamer::sptr rx_stream = (existing_inst) ? global_usrp->stream_rx : rx_usrp->get_rx_stream(stream_args);
+    uhd::rx_streamer::sptr rx_stream;
+    std::vector<uhd::rx_streamer::sptr> rx_stream_groups;
+    std::vector<std::vector<size_t>> rx_group_chans;
+    if (existing_inst) {
+        if (rx_group_size != 0 && global_usrp->stream_rx_groups.empty())
+            mexWarnMsgTxt("new: existing session uses a single rx streamer");
+    } else if (rx_group_size == 0) {
+        rx_stream = rx_usrp->get_rx_stream(stream_args);
+    } else {
+        // One streamer per group of channels, each drained by its own thread
+        for(size_t ch=0; ch<num_channels; ch+=rx_group_size) {
+            uhd::stream_args_t group_args("fc32", "sc16");
+            for(size_t i=ch; i<std::min(ch+rx_group_size, num_channels); i++) {
+                group_args.channels.push_back(i);
+            }
+            rx_stream_groups.push_back(rx_usrp->get_rx_stream(group_args));
+            rx_group_chans.push_back(group_args.channels);
+        }
+    }
     // Ensure LO is locked
     std::vector<std::string> tx_sensor_names = tx_usrp->get_tx_sensor_names(0);
     if (std::find(tx_sensor_names.begin(), tx_sensor_names.end(), "lo_locked")
@@ -138,8 +318,14 @@ void new_sub(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         global_usrp = new usrp_access(rx_usrp, tx_usrp);
         global_usrp->stream_rx = rx_stream;
         global_usrp->stream_tx = tx_stream;
+        global_usrp->stream_rx_groups = rx_stream_groups;
+        global_usrp->rx_group_chans = rx_group_chans;
     }
-    plhs[0] = convertPtr2Mat(*global_usrp);
+    // Each handle gets its own settings, but shares the device's streamers,
+    // and the captures running on them, with every other handle
+    usrp_access inst = *global_usrp;
+    inst.session = std::make_shared<usrp_session>();
+    plhs[0] = convertPtr2Mat(inst);
 }
 
 /******************************************************************************
@@ -192,6 +378,655 @@ void get_gain_sub_rx(usrp_access inst, mxArray *plhs[], const mxArray *prhs[]) {
     plhs[0] = gain_data;
 }
 
+/******************************************************************************
+ * [gaps, outputs] = rx_sub('rx', ptr, num_samp_rx, num_chan, rx_basepath, start_time) - receive only
+ * - an empty start_time starts as soon as recent captures show is safe
+ ******************************************************************************/
+void rx_sub(usrp_access inst, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    if (nlhs > 2 || nrhs != 6)
+        mexErrMsgTxt("rx: Unexpected arguments.");
+    uint64_t num_samp_rx = get_count(prhs[2], "rx: num_samp_rx");
+    size_t num_chan = mxGetScalar(prhs[3]);
+    char rx_basepath[128];
+    if(mxGetString(prhs[4], rx_basepath, sizeof(rx_basepath))) {
+        mexErrMsgTxt("rx: couldn't get rx base path");
+    }
+    // rx has no buffers to fill, so its lead only has to cover issuing the
+    // stream commands; it is tracked with a buffer size of 0
+    bool auto_lead = mxIsEmpty(prhs[5]);
+    tx_lead_stats& lead_stats = inst.session->tx_lead[std::make_tuple(inst.usrp_rx->get_rx_rate(), num_chan, (size_t) 0)];
+    double start_time = auto_lead ? choose_tx_lead(lead_stats) : mxGetScalar(prhs[5]);
+    check_rx_idle(inst, "rx");
+    std::vector<size_t> chans;
+    for(size_t i=0; i<num_chan; i++) {
+        chans.push_back(i);
+    }
+    check_clear_late_command();
+    auto time_zero = std::chrono::steady_clock::now();
+    inst.usrp_rx->set_time_now(0.0);
+    std::list<rx_thread_job> rx_jobs;
+    start_rx(inst, rx_jobs, std::string(rx_basepath), num_samp_rx, start_time, chans, 0, inst.session->rx_proc);
+    double overhead = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_zero).count();
+    std::string rx_err;
+    rx_result result = finish_rx(rx_jobs, &rx_err);
+    bool late = check_clear_late_command();
+    if (auto_lead) {
+        update_tx_lead(lead_stats, start_time, overhead, late);
+    }
+    if (late && auto_lead) {
+        mexErrMsgTxt(str(boost::format("Commands arrived late; lead time raised to %.1f ms.  Please try again.")
+            % (choose_tx_lead(lead_stats) * 1e3)).c_str());
+    }
+    if (!rx_err.empty()) {
+        mexErrMsgTxt(rx_err.c_str());
+    }
+    if (nlhs >= 1) {
+        plhs[0] = gaps_to_mat(result.gaps);
+    }
+    if (nlhs == 2) {
+        plhs[1] = outputs_to_mat(result.outputs);
+    }
+}
+
+/******************************************************************************
+ * timing = tx_sub('tx', ptr, num_chan, tx_basepath, start_time) - transmit only
+ * - an empty start_time picks the lead time from recent bursts, as for txrx.
+ *   timing is [lead time, start-up time, margin] in seconds.
+ ******************************************************************************/
+void tx_sub(usrp_access inst, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    if (nlhs > 1 || nrhs != 5)
+        mexErrMsgTxt("tx: Unexpected arguments.");
+    size_t num_chan = mxGetScalar(prhs[2]);
+    char tx_basepath[128];
+    if(mxGetString(prhs[3], tx_basepath, sizeof(tx_basepath))) {
+        mexErrMsgTxt("tx: couldn't get tx base path");
+    }
+    const size_t spb = 1000;
+    bool auto_lead = mxIsEmpty(prhs[4]);
+    tx_lead_stats& lead_stats = inst.session->tx_lead[std::make_tuple(inst.usrp_tx->get_tx_rate(), num_chan, spb)];
+    double start_time = auto_lead ? choose_tx_lead(lead_stats) : mxGetScalar(prhs[4]);
+    check_rx_idle(inst, "tx");
+    check_clear_late_command();
+    auto time_zero = std::chrono::steady_clock::now();
+    inst.usrp_tx->set_time_now(0.0);
+    uhd::tx_metadata_t md;
+    md.start_of_burst = true;
+    md.end_of_burst   = false;
+    md.has_time_spec  = true;
+    md.time_spec = uhd::time_spec_t(start_time);
+    tx_timing tx_time;
+    // Same as txrx, keep realtime priority off the Matlab main thread
+    boost::thread_group transmit_thread;
+    transmit_thread.create_thread(boost::bind(&send_from_file, inst.stream_tx, std::string(tx_basepath), spb, num_chan, md, inst.session->tx_thread, &tx_time));
+    transmit_thread.join_all();
+    double overhead = std::chrono::duration<double>(tx_ready_time(tx_time, time_zero, start_time) - time_zero).count();
+    bool late = check_clear_late_command();
+    bool underflow = check_clear_underflow();
+    if (auto_lead) {
+        update_tx_lead(lead_stats, start_time, overhead, late || underflow);
+    }
+    if (late && auto_lead) {
+        mexErrMsgTxt(str(boost::format("Commands arrived late; lead time raised to %.1f ms.  Please try again.")
+            % (choose_tx_lead(lead_stats) * 1e3)).c_str());
+    } else if (late) {
+        mexErrMsgTxt("tx: commands arrived late; use a later start time");
+    }
+    if (underflow) {
+        mexErrMsgTxt("Underflows happened.  Please try again.");
+    }
+    if (nlhs == 1) {
+        plhs[0] = mxCreateDoubleMatrix(1, 3, mxREAL);
+        double *timing = mxGetDoubles(plhs[0]);
+        timing[0] = start_time;
+        timing[1] = overhead;
+        timing[2] = start_time - overhead;
+    }
+}
+
+/******************************************************************************
+ * set_stream_threads('set_stream_threads', ptr, rx_cpu, rx_priority, tx_cpu, tx_priority)
+ * - pin the streaming threads to cores (-1 for any) and set their SCHED_FIFO
+ *   priority (0 for the UHD default)
+ ******************************************************************************/
+void set_stream_threads_sub(usrp_access inst, int nrhs, const mxArray *prhs[]) {
+    if (nrhs != 6) {
+        mexErrMsgTxt("Incorrect number of inputs/outputs");
+    }
+    for (int ii = 2; ii < 6; ii++) {
+        if(!mxIsScalar(prhs[ii]) || mxIsComplex(prhs[ii]))
+            mexErrMsgTxt("set_stream_threads: parameters must be scalar");
+    }
+    stream_thread_opts rx_opts, tx_opts;
+    rx_opts.cpu = (int) mxGetScalar(prhs[2]);
+    rx_opts.rt_priority = (int) mxGetScalar(prhs[3]);
+    tx_opts.cpu = (int) mxGetScalar(prhs[4]);
+    tx_opts.rt_priority = (int) mxGetScalar(prhs[5]);
+    if (rx_opts.rt_priority < 0 || rx_opts.rt_priority > 99
+            || tx_opts.rt_priority < 0 || tx_opts.rt_priority > 99) {
+        mexErrMsgTxt("set_stream_threads: priority must be in the range 0-99");
+    }
+    if (!valid_stream_cpu(rx_opts.cpu) || !valid_stream_cpu(tx_opts.cpu)) {
+        mexErrMsgTxt("set_stream_threads: cpu must be -1 or an online core");
+    }
+    inst.session->rx_thread = rx_opts;
+    inst.session->tx_thread = tx_opts;
+}
+
+/* Read element idx of a real or complex double vector */
+std::complex<double> get_complex_elem(const mxArray *arr, size_t idx)
+{
+    if (mxIsComplex(arr)) {
+        mxComplexDouble val = mxGetComplexDoubles(arr)[idx];
+        return std::complex<double>(val.real, val.imag);
+    }
+    return std::complex<double>(mxGetDoubles(arr)[idx], 0);
+}
+
+/******************************************************************************
+ * set_iq_correction('set_iq_correction', ptr, dc_offset, gain, imbalance)
+ * - per-channel correction applied to rx samples as they arrive,
+ *   y = gain .* (z + imbalance .* conj(z)) where z = x - dc_offset.
+ *   Passing empty matrices turns correction off.
+ ******************************************************************************/
+void set_iq_correction_sub(usrp_access inst, int nrhs, const mxArray *prhs[]) {
+    if (nrhs != 5) {
+        mexErrMsgTxt("Incorrect number of inputs/outputs");
+    }
+    size_t num_chans = mxGetNumberOfElements(prhs[2]);
+    for (int ii = 2; ii < 5; ii++) {
+        if (!mxIsDouble(prhs[ii]))
+            mexErrMsgTxt("set_iq_correction: coefficients must be double");
+        if (mxGetNumberOfElements(prhs[ii]) != num_chans)
+            mexErrMsgTxt("set_iq_correction: need one coefficient of each type per channel");
+    }
+    if (num_chans != 0 && num_chans != session_rx_channels(inst))
+        mexErrMsgTxt("set_iq_correction: need one coefficient per rx channel of the session");
+    std::vector<iq_correction> iq_cal;
+    for (size_t ch = 0; ch < num_chans; ch++) {
+        iq_cal.push_back(make_iq_correction(get_complex_elem(prhs[2], ch),
+            get_complex_elem(prhs[3], ch), get_complex_elem(prhs[4], ch)));
+    }
+    inst.session->rx_proc.iq_cal = iq_cal;
+}
+
+/******************************************************************************
+ * set_beamformer('set_beamformer', ptr, weights) - combine the rx channels
+ * into beams.  weights is num_beams x num_channels; each returned beam is
+ * weights(k,:) * channels.  An empty matrix turns beamforming off.
+ ******************************************************************************/
+void set_beamformer_sub(usrp_access inst, int nrhs, const mxArray *prhs[]) {
+    if (nrhs != 3) {
+        mexErrMsgTxt("Incorrect number of inputs/outputs");
+    }
+    if (!mxIsDouble(prhs[2]))
+        mexErrMsgTxt("set_beamformer: weights must be double");
+    size_t num_beams = mxGetM(prhs[2]);
+    size_t num_chans = mxGetN(prhs[2]);
+    // Matlab is column-major; the combiner wants one row per beam
+    std::vector<std::complex<float>> weights(num_beams * num_chans);
+    for (size_t k = 0; k < num_beams; k++) {
+        for (size_t n = 0; n < num_chans; n++) {
+            weights[k*num_chans + n] = std::complex<float>(get_complex_elem(prhs[2], k + n*num_beams));
+        }
+    }
+    inst.session->rx_proc.num_beams = (num_chans > 0) ? num_beams : 0;
+    inst.session->rx_proc.beam_weights = weights;
+}
+
+/******************************************************************************
+ * ring_start('ring_start', ptr, num_chan, ring_samps, backing_file, start_time)
+ * - start receiving continuously into a circular buffer of ring_samps samples
+ *   per channel, memory-backed, or file-backed if backing_file is not empty.
+ *   With the automatic start time, waits for the first samples, so a late
+ *   start is an error here (and raises the lead for next time).
+ ******************************************************************************/
+void ring_start_sub(usrp_access inst, int nlhs, int nrhs, const mxArray *prhs[]) {
+    if (nlhs != 0 || nrhs != 6)
+        mexErrMsgTxt("ring_start: Unexpected arguments.");
+    size_t num_chan = mxGetScalar(prhs[2]);
+    size_t ring_samps = mxGetScalar(prhs[3]);
+    char backing_file[128];
+    if(mxGetString(prhs[4], backing_file, sizeof(backing_file))) {
+        mexErrMsgTxt("ring_start: couldn't get backing file path");
+    }
+    // As for rx, an empty start_time uses the measured command lead
+    bool auto_lead = mxIsEmpty(prhs[5]);
+    tx_lead_stats& lead_stats = inst.session->tx_lead[std::make_tuple(inst.usrp_rx->get_rx_rate(), num_chan, (size_t) 0)];
+    double start_time = auto_lead ? choose_tx_lead(lead_stats) : mxGetScalar(prhs[5]);
+    if (!inst.stream_rx)
+        mexErrMsgTxt("ring_start: the ring needs every channel on one rx streamer");
+    // The writer receives every channel of the streamer
+    if (num_chan != inst.stream_rx->get_num_channels())
+        mexErrMsgTxt("ring_start: num_chan must match the session's channel count");
+    // A running ring is restarted below
+    check_rx_idle(inst, "ring_start", true);
+    std::shared_ptr<rx_ring> ring = inst.streams->ring;
+    if (ring) {
+        ring->stop();
+    }
+    // Reuse the existing buffer if it has the same shape
+    if (!ring || ring->get_capacity() != ring_samps || ring->get_backing_file() != backing_file
+            || num_chan != ring->get_num_channels()) {
+        inst.streams->ring.reset();
+        std::vector<size_t> chans;
+        for(size_t i=0; i<num_chan; i++) {
+            chans.push_back(i);
+        }
+        std::string err;
+        try {
+            ring = std::make_shared<rx_ring>(inst.usrp_rx, inst.stream_rx, chans, ring_samps, std::string(backing_file));
+        } catch (const std::exception& e) {
+            err = e.what();
+        }
+        if (!err.empty())
+            mexErrMsgTxt(err.c_str());
+        inst.streams->ring = ring;
+    }
+    auto time_zero = std::chrono::steady_clock::now();
+    inst.usrp_rx->set_time_now(0.0);
+    ring->start(start_time, inst.session->rx_proc, inst.session->rx_thread);
+    if (auto_lead) {
+        double overhead = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_zero).count();
+        // The writer only finds out the start was late once it receives
+        std::string err;
+        try {
+            ring->wait_started();
+        } catch (const std::exception& e) {
+            err = std::string("ring_start: ") + e.what();
+        }
+        update_tx_lead(lead_stats, start_time, overhead, !err.empty());
+        if (!err.empty())
+            mexErrMsgTxt(err.c_str());
+    }
+}
+
+/******************************************************************************
+ * [trigger_time, gaps, outputs] = ring_trigger('ring_trigger', ptr, num_pre, num_post,
+ *     rx_basepath, source, [arg])
+ * - wait for a trigger, freeze the ring and write num_pre samples before and
+ *   num_post samples after it to files.  source is 'now' (software trigger),
+ *   'time' (arg is the device time) or 'gpio' (arg is [bit, timeout]: a
+ *   rising edge on that FP0 pin).  trigger_time is the device time used.
+ ******************************************************************************/
+void ring_trigger_sub(usrp_access inst, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    if (nlhs > 3 || nrhs < 6 || nrhs > 7)
+        mexErrMsgTxt("ring_trigger: Unexpected arguments.");
+    if (!inst.streams->ring || !inst.streams->ring->running())
+        mexErrMsgTxt("ring_trigger: ring capture is not running");
+    size_t num_pre = mxGetScalar(prhs[2]);
+    size_t num_post = mxGetScalar(prhs[3]);
+    char rx_basepath[128], source[16];
+    if(mxGetString(prhs[4], rx_basepath, sizeof(rx_basepath))) {
+        mexErrMsgTxt("ring_trigger: couldn't get rx base path");
+    }
+    if(mxGetString(prhs[5], source, sizeof(source))) {
+        mexErrMsgTxt("ring_trigger: couldn't get trigger source");
+    }
+    uhd::time_spec_t trigger_time;
+    double timeout = 1.0;
+    if (!strcmp("now", source)) {
+        trigger_time = inst.usrp_rx->get_time_now();
+    } else if (!strcmp("time", source)) {
+        if (nrhs != 7)
+            mexErrMsgTxt("ring_trigger: time trigger needs a device time");
+        trigger_time = uhd::time_spec_t(mxGetScalar(prhs[6]));
+        timeout += std::max(0.0, (trigger_time - inst.usrp_rx->get_time_now()).get_real_secs());
+    } else if (!strcmp("gpio", source)) {
+        if (nrhs != 7 || mxGetNumberOfElements(prhs[6]) != 2 || !mxIsDouble(prhs[6]))
+            mexErrMsgTxt("ring_trigger: gpio trigger needs [bit, timeout]");
+        double *gpio_arg = mxGetDoubles(prhs[6]);
+        if (gpio_arg[0] != std::floor(gpio_arg[0]) || gpio_arg[0] < 0 || gpio_arg[0] > 31)
+            mexErrMsgTxt("ring_trigger: gpio bit must be an integer from 0 to 11");
+        bool found = false;
+        std::string err;
+        try {
+            found = usrp_gpio_wait_edge(inst.usrp_rx, (int) gpio_arg[0], gpio_arg[1], trigger_time);
+        } catch (const std::exception& e) {
+            err = std::string("ring_trigger: ") + e.what();
+        }
+        if (!err.empty())
+            mexErrMsgTxt(err.c_str());
+        if (!found) {
+            inst.streams->ring->stop();
+            mexErrMsgTxt("ring_trigger: timed out waiting for gpio edge");
+        }
+    } else {
+        mexErrMsgTxt("ring_trigger: source must be 'now', 'time' or 'gpio'");
+    }
+    rx_result result;
+    std::string err;
+    try {
+        result = inst.streams->ring->capture(trigger_time, num_pre, num_post, std::string(rx_basepath), timeout);
+    } catch (const std::exception& e) {
+        err = e.what();
+    }
+    if (!err.empty())
+        mexErrMsgTxt(err.c_str());
+    plhs[0] = mxCreateDoubleScalar(trigger_time.get_real_secs());
+    if (nlhs >= 2) {
+        plhs[1] = gaps_to_mat(result.gaps);
+    }
+    if (nlhs == 3) {
+        plhs[2] = outputs_to_mat(result.outputs);
+    }
+}
+
+/******************************************************************************
+ * rx_files_start('rx_files_start', ptr, num_samps, num_chan, basepath, start_time, segment_samps)
+ * - start receiving to files in the background.  num_samps may be 0 to keep
+ *   receiving until rx_files_stop.  If segment_samps is nonzero, the output
+ *   rotates to new files (basepath.CC.SSSS.dat) every segment_samps samples.
+ ******************************************************************************/
+void rx_files_start_sub(usrp_access inst, int nlhs, int nrhs, const mxArray *prhs[]) {
+    if (nlhs != 0 || nrhs != 7)
+        mexErrMsgTxt("rx_files_start: Unexpected arguments.");
+    uint64_t num_samps = get_count(prhs[2], "rx_files_start: num_samps");
+    size_t num_chan = mxGetScalar(prhs[3]);
+    char basepath[256];
+    if(mxGetString(prhs[4], basepath, sizeof(basepath))) {
+        mexErrMsgTxt("rx_files_start: couldn't get base path");
+    }
+    double start_time = mxGetScalar(prhs[5]);
+    uint64_t segment_samps = get_count(prhs[6], "rx_files_start: segment_samps");
+    check_rx_idle(inst, "rx_files_start");
+    std::vector<size_t> chans;
+    for(size_t i=0; i<num_chan; i++) {
+        chans.push_back(i);
+    }
+    inst.usrp_rx->set_time_now(0.0);
+    inst.streams->rx_file_base = basepath;
+    inst.streams->rx_file_segment_samps = segment_samps;
+    start_rx(inst, inst.streams->rx_file_jobs, inst.streams->rx_file_base, num_samps, start_time, chans, segment_samps,
+        inst.session->rx_proc);
+}
+
+/******************************************************************************
+ * [manifest, gaps] = rx_files_stop('rx_files_stop', ptr, wait)
+ * - wait for the background capture to finish (wait=true), or stop it now,
+ *   and write its manifest.  Returns the manifest path and the gap map.
+ ******************************************************************************/
+void rx_files_stop_sub(usrp_access inst, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    if (nlhs > 2 || nrhs != 3)
+        mexErrMsgTxt("rx_files_stop: Unexpected arguments.");
+    if (inst.streams->rx_file_jobs.empty())
+        mexErrMsgTxt("rx_files_stop: no file capture is running");
+    if (!mxGetScalar(prhs[2])) {
+        for (auto& job : inst.streams->rx_file_jobs) {
+            job.stop = true;
+        }
+    }
+    rx_result result = finish_rx(inst.streams->rx_file_jobs);
+    std::string manifest;
+    std::string err;
+    try {
+        manifest = write_rx_manifest(inst.streams->rx_file_base, inst.usrp_rx->get_rx_rate(),
+            inst.streams->rx_file_segment_samps, result);
+    } catch (const std::exception& e) {
+        err = e.what();
+    }
+    if (!err.empty())
+        mexErrMsgTxt(err.c_str());
+    plhs[0] = mxCreateString(manifest.c_str());
+    if (nlhs == 2) {
+        plhs[1] = gaps_to_mat(result.gaps);
+    }
+}
+
+/* Transmit the tx files on chans and receive num_samp_rx samples into the rx
+ * files.  If rx_delays is given, each channel's capture starts rx_delays[ch]
+ * samples after the tx burst starts, so the loopback delays drop out.  The burst
+ * starts as soon after resetting the device time as recent bursts with the
+ * same settings show is safe; see choose_tx_lead.  If timing is given, it is
+ * set to [lead time, start-up time, margin] in seconds, where a negative
+ * margin means the commands were late.
+ */
+rx_result txrx_run(usrp_access inst, const std::string& tx_basepath, const std::string& rx_basepath,
+    uint64_t num_samp_rx, const std::vector<size_t>& chans, const std::vector<uint64_t>& rx_delays,
+    double *timing = NULL)
+{
+    const size_t spb = 1000;
+    const double rate = inst.usrp_rx->get_rx_rate();
+    tx_lead_stats& lead_stats = inst.session->tx_lead[std::make_tuple(rate, chans.size(), spb)];
+    // Allocate matrix for rx data
+    // Should have num_samp rows and num_chan columns
+    // This is for memory layout purposes, since Matlab does column-major formatting
+    // This means each column is stored contiguously, so we want each column to be a buffer
+    // Matlab does things this way because it was originally written in Fortran 🙃
+    //mxArray *rx_data = mxCreateNumericMatrix(num_samp_rx, num_chan, mxSINGLE_CLASS, mxCOMPLEX);
+    // Start tx in separate thread
+    check_clear_late_command();
+    auto time_zero = std::chrono::steady_clock::now();
+    inst.usrp_rx->set_time_now(0.0);
+    inst.usrp_tx->set_time_now(0.0); // Not sure if I need to do both separately
+    double start_time = choose_tx_lead(lead_stats); // time to fill the tx buffers
+    // Start at the earliest channel's delay; the others drop the difference
+    rx_processing proc = inst.session->rx_proc;
+    uint64_t rx_delay = 0;
+    if (!rx_delays.empty()) {
+        rx_delay = *std::min_element(rx_delays.begin(), rx_delays.end());
+        proc.chan_skip.clear();
+        for (uint64_t delay : rx_delays) {
+            proc.chan_skip.push_back(delay - rx_delay);
+        }
+    }
+    double rx_start_time = start_time + rx_delay / rate;
+    std::list<rx_thread_job> rx_jobs;
+    start_rx(inst, rx_jobs, rx_basepath, num_samp_rx, rx_start_time, chans, 0, proc);
+    auto rx_issued = std::chrono::steady_clock::now();
+    // start transmit worker thread
+    // setup the metadata flags
+    uhd::tx_metadata_t md;
+    md.start_of_burst = true;
+    md.end_of_burst   = false;
+    md.has_time_spec  = true;
+    md.time_spec = uhd::time_spec_t(start_time); 
+    tx_timing tx_time;
+    // tx and rx MUST be run in threads to avoid accidentally giving the Matlab main thread realtime priority
+    boost::thread_group transmit_thread;
+    transmit_thread.create_thread(boost::bind(&send_from_file, inst.stream_tx, tx_basepath, spb, chans.size(), md, inst.session->tx_thread, &tx_time));
+    transmit_thread.join_all();
+    std::string rx_err;
+    rx_result result = finish_rx(rx_jobs, &rx_err);
+    // The burst was ready once the rx commands were out and the tx buffers
+    // had been filled
+    auto ready = std::max(rx_issued, tx_ready_time(tx_time, time_zero, start_time));
+    double overhead = std::chrono::duration<double>(ready - time_zero).count();
+    bool late = check_clear_late_command();
+    bool underflow = check_clear_underflow();
+    update_tx_lead(lead_stats, start_time, overhead, late || underflow);
+    if (timing != NULL) {
+        timing[0] = start_time;
+        timing[1] = overhead;
+        timing[2] = start_time - overhead;
+    }
+    if (late) {
+        mexErrMsgTxt(str(boost::format("Commands arrived late; lead time raised to %.1f ms.  Please try again.")
+            % (choose_tx_lead(lead_stats) * 1e3)).c_str());
+    }
+    if (!rx_err.empty()) {
+        mexErrMsgTxt(rx_err.c_str());
+    }
+    if (underflow) {
+        mexErrMsgTxt("Underflows happened.  Please try again.");
+    }
+    return result;
+}
+
+/* Loopback delays for the current rate and rx frequency, from the session or
+ * else the on-disk cache.  Returns false if this setting was never calibrated.
+ */
+bool get_delay_cal(usrp_access inst, std::vector<uint64_t>& delays)
+{
+    auto key = std::make_pair(inst.usrp_rx->get_rx_rate(), inst.usrp_rx->get_rx_freq(0));
+    auto cached = inst.session->delay_cal.find(key);
+    if (cached != inst.session->delay_cal.end()) {
+        delays = cached->second;
+        return true;
+    }
+    if (!load_delay_cal(key.first, key.second, delays)) {
+        return false;
+    }
+    inst.session->delay_cal[key] = delays;
+    return true;
+}
+
+/******************************************************************************
+ * [delays, peak_ratio] = usrp_mex('calibrate_delay', ptr, num_samp_rx, num_chan, tx_basepath, rx_basepath)
+ * - transmit the probe in the tx files and find it in the loopback capture of
+ *   each channel.  The delays (in samples from the start of the tx burst) are
+ *   kept for the current rate and frequency, in the session and on disk.
+ *   peak_ratio is the correlation peak over its mean, per channel.
+ ******************************************************************************/
+void calibrate_delay_sub(usrp_access inst, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    if (nrhs != 6 || nlhs > 2)
+        mexErrMsgTxt("calibrate_delay: Unexpected arguments.");
+    uint64_t num_samp_rx = get_count(prhs[2], "calibrate_delay: num_samp_rx");
+    size_t num_chan = (size_t) mxGetScalar(prhs[3]);
+    char tx_basepath[128], rx_basepath[128];
+    if (mxGetString(prhs[4], tx_basepath, sizeof(tx_basepath)) || mxGetString(prhs[5], rx_basepath, sizeof(rx_basepath)))
+        mexErrMsgTxt("calibrate_delay: couldn't get base paths");
+    check_rx_idle(inst, "calibrate_delay");
+    if (inst.session->rx_proc.num_beams > 0)
+        mexErrMsgTxt("calibrate_delay: turn off the beamformer first");
+    std::vector<size_t> chans;
+    for (size_t i = 0; i < num_chan; i++) {
+        chans.push_back(i);
+    }
+    rx_result result = txrx_run(inst, tx_basepath, rx_basepath, num_samp_rx, chans, std::vector<uint64_t>());
+    if (!result.gaps.empty())
+        mexErrMsgTxt("calibrate_delay: rx samples were dropped.  Please try again.");
+    std::vector<uint64_t> delays(num_chan);
+    std::vector<double> ratios(num_chan);
+    std::string err;
+    try {
+        for (size_t ch = 0; ch < num_chan; ch++) {
+            std::vector<std::complex<float>> probe = read_sample_file(
+                generate_out_filename(tx_basepath, num_chan, ch), num_samp_rx);
+            std::vector<std::complex<float>> rx = read_sample_file(
+                generate_out_filename(rx_basepath, num_chan, ch), num_samp_rx);
+            delays[ch] = find_delay(probe, rx, &ratios[ch]);
+        }
+    } catch (const std::exception& e) {
+        err = std::string("calibrate_delay: ") + e.what();
+    }
+    if (!err.empty())
+        mexErrMsgTxt(err.c_str());
+    for (size_t ch = 0; ch < num_chan; ch++) {
+        // Noise alone gives a ratio of a few
+        if (ratios[ch] < 10) {
+            mexWarnMsgTxt(str(boost::format("calibrate_delay: weak correlation peak on channel %d") % ch).c_str());
+        }
+    }
+    double rate = inst.usrp_rx->get_rx_rate();
+    double fc = inst.usrp_rx->get_rx_freq(0);
+    inst.session->delay_cal[std::make_pair(rate, fc)] = delays;
+    try {
+        save_delay_cal(rate, fc, delays);
+    } catch (const std::exception& e) {
+        mexWarnMsgTxt(e.what());
+    }
+    plhs[0] = mxCreateDoubleMatrix(1, num_chan, mxREAL);
+    std::copy(delays.begin(), delays.end(), mxGetDoubles(plhs[0]));
+    if (nlhs == 2) {
+        plhs[1] = mxCreateDoubleMatrix(1, num_chan, mxREAL);
+        std::copy(ratios.begin(), ratios.end(), mxGetDoubles(plhs[1]));
+    }
+}
+
+/******************************************************************************
+ * delays = usrp_mex('set_delay_trim', ptr, enable)
+ * - start each channel's txrx capture at its calibrated loopback delay, so
+ *   the first sample is the start of the tx waveform on every channel.
+ *   Returns the delays for the current rate and frequency, or [] if there
+ *   are none.
+ ******************************************************************************/
+void set_delay_trim_sub(usrp_access inst, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    if (nrhs != 3 || nlhs > 1 || !mxIsScalar(prhs[2]))
+        mexErrMsgTxt("set_delay_trim: Unexpected arguments.");
+    inst.session->trim_rx_delay = (mxGetScalar(prhs[2]) != 0);
+    std::vector<uint64_t> delays;
+    get_delay_cal(inst, delays);
+    if (nlhs == 1) {
+        plhs[0] = mxCreateDoubleMatrix(delays.empty() ? 0 : 1, delays.size(), mxREAL);
+        std::copy(delays.begin(), delays.end(), mxGetDoubles(plhs[0]));
+    }
+}
+
+#ifndef USRP_DAEMON
+/******************************************************************************
+ * usrp_daemon client
+ * - an addr of "daemon", "daemon:<socket>" or "daemon:<socket>|<device addr>"
+ *   opens the session in usrp_daemon instead of this process.  The daemon
+ *   keeps the device open between sessions, so reconnecting is quick, and
+ *   several Matlab processes can connect to it at once.
+ ******************************************************************************/
+bool is_daemon_addr(const mxArray *addr)
+{
+    char prefix[8];
+    // mxGetString truncates long strings, which is all we need here
+    if (!mxIsChar(addr))
+        return false;
+    mxGetString(addr, prefix, sizeof(prefix));
+    return !strncmp(prefix, "daemon", 6) && strchr(":|", prefix[6]) != NULL;
+}
+
+void daemon_new_sub(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if (nlhs != 1)
+        mexErrMsgTxt("new: One output expected");
+    char *addr_str = mxArrayToString(prhs[6]);
+    std::string addr(addr_str);
+    mxFree(addr_str);
+    // Split "daemon:<socket>|<device addr>"
+    std::string socket_path, device_addr;
+    size_t bar = addr.find('|');
+    if (bar != std::string::npos) {
+        device_addr = addr.substr(bar + 1);
+        addr = addr.substr(0, bar);
+    }
+    socket_path = (addr.size() > 7) ? addr.substr(7) : default_daemon_socket();
+    std::shared_ptr<daemon_client> client;
+    try {
+        client = std::make_shared<daemon_client>(socket_path);
+    } catch (const std::exception& e) {
+        mexErrMsgTxt(e.what());
+    }
+    // The daemon sees only the device part of the address
+    std::vector<const mxArray *> args(prhs, prhs + nrhs);
+    mxArray *device_arg = mxCreateString(device_addr.c_str());
+    args[6] = device_arg;
+    mxArray *remote = NULL;
+    client->call(1, &remote, nrhs, args.data());
+    mxDestroyArray(device_arg);
+    if (remote == NULL || mxGetClassID(remote) != mxUINT64_CLASS || mxGetNumberOfElements(remote) != 1)
+        mexErrMsgTxt("new: usrp_daemon returned an invalid handle");
+    usrp_access inst(NULL, NULL);
+    inst.daemon = client;
+    inst.daemon_handle = *((uint64_t *)mxGetData(remote));
+    mxDestroyArray(remote);
+    plhs[0] = convertPtr2Mat(inst);
+}
+
+void daemon_forward(usrp_access inst, const char *cmd, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if (!strcmp("delete", cmd)) {
+        // The daemon drops the session when the connection closes, but keeps
+        // the device open for the next client
+        inst.daemon->close();
+        releaseHandle(*((uint64_t *)mxGetData(prhs[1])));
+        if (nlhs != 0 || nrhs != 2)
+            mexWarnMsgTxt("Delete: Unexpected arguments ignored.");
+        return;
+    }
+    std::vector<const mxArray *> args(prhs, prhs + nrhs);
+    mxArray *handle = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+    *((uint64_t *)mxGetData(handle)) = inst.daemon_handle;
+    args[1] = handle;
+    inst.daemon->call(nlhs, plhs, nrhs, args.data());
+    mxDestroyArray(handle);
+}
+#endif
+
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {	
     // Get the command string
@@ -201,6 +1036,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         
     // New -> usrp_common('new', num_channels, fs, fc, rx_gain, tx_gain, [addr])
     if (!strcmp("new", cmd)) {
+#ifndef USRP_DAEMON
+        if (nrhs >= 7 && is_daemon_addr(prhs[6])) {
+            daemon_new_sub(nlhs, plhs, nrhs, prhs);
+            return;
+        }
+#endif
         new_sub(nlhs, plhs, nrhs, prhs);
         return;
     }
@@ -209,8 +1050,18 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     if (nrhs < 2)
 		mexErrMsgTxt("Second input should be a class instance handle.");
     
-    if (nlhs > 1)
-        mexErrMsgTxt("This function doesn't return anything");
+    if (nlhs > 3)
+        mexErrMsgTxt("Too many outputs");
+    
+    // Get the class instance pointer from the second input
+    usrp_access inst = convertMat2Ptr(prhs[1]);
+
+#ifndef USRP_DAEMON
+    if (inst.daemon) {
+        daemon_forward(inst, cmd, nlhs, plhs, nrhs, prhs);
+        return;
+    }
+#endif
     
     // Delete
     if (!strcmp("delete", cmd)) {
@@ -222,17 +1073,17 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         return;
     }
     
-    // Get the class instance pointer from the second input
-    usrp_access inst = convertMat2Ptr(prhs[1]);
-    
     if (!strcmp("txrx", cmd)) {
-        // txrx -> usrp_mex('txrx', ptr, input_samples)
-        if (nlhs != 0 || nrhs != 6)
+        // txrx -> [gaps, timing, outputs] = usrp_mex('txrx', ptr, num_samp_rx, num_chan, tx_basepath, rx_basepath)
+        // timing is [lead time, start-up time, margin] in seconds, and
+        // outputs lists the rx files written
+        if (nrhs != 6)
             mexErrMsgTxt("txrx: Unexpected arguments.");
         // Grab the appropriate data
-        size_t num_samp_rx, num_chan;
+        uint64_t num_samp_rx;
+        size_t num_chan;
         char tx_basepath[128], rx_basepath[128];
-        num_samp_rx = mxGetScalar(prhs[2]);
+        num_samp_rx = get_count(prhs[2], "txrx: num_samp_rx");
         num_chan = mxGetScalar(prhs[3]);
         if(mxGetString(prhs[4], tx_basepath, sizeof(tx_basepath))) {
             mexErrMsgTxt("txrx: couldn't get tx base path");
@@ -240,40 +1091,96 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         if(mxGetString(prhs[5], rx_basepath, sizeof(rx_basepath))) {
             mexErrMsgTxt("txrx: couldn't get tx base path");
         }
+        check_rx_idle(inst, "txrx");
         // Create set of channels.  For now, we're making some assumptions.
         std::vector<size_t> chans;
         for(size_t i=0; i<num_chan; i++) {
             chans.push_back(i);
         }
-        // Allocate matrix for rx data
-        // Should have num_samp rows and num_chan columns
-        // This is for memory layout purposes, since Matlab does column-major formatting
-        // This means each column is stored contiguously, so we want each column to be a buffer
-        // Matlab does things this way because it was originally written in Fortran 🙃
-        //mxArray *rx_data = mxCreateNumericMatrix(num_samp_rx, num_chan, mxSINGLE_CLASS, mxCOMPLEX);
-        // Start tx in separate thread
-        inst.usrp_rx->set_time_now(0.0);
-        inst.usrp_tx->set_time_now(0.0); // Not sure if I need to do both separately
-        double start_time = 0.005; // give us 0.005 seconds to fill the tx buffers
-        usrp_rx_start(inst.stream_rx, num_samp_rx, start_time);
-        // start transmit worker thread
-        // setup the metadata flags
-        uhd::tx_metadata_t md;
-        md.start_of_burst = true;
-        md.end_of_burst   = false;
-        md.has_time_spec  = true;
-        md.time_spec = uhd::time_spec_t(start_time); 
-        // tx MUST be run in a thread to avoid accidentally giving the Matlab main thread realtime priority
-        boost::thread_group transmit_thread;
-        transmit_thread.create_thread(boost::bind(&send_from_file, inst.stream_tx, std::string(tx_basepath), 1000, chans.size(), md));
-        auto spb = inst.stream_tx->get_max_num_samps() * 10;
-        recv_to_file_fc(inst.usrp_rx, inst.stream_rx, std::string(rx_basepath), spb, num_samp_rx, start_time, chans);
-        transmit_thread.join_all();
-        if (check_clear_underflow()) {
-            mexErrMsgTxt("Underflows happened.  Please try again.");
+        // Skip each channel's loopback delay if we know it
+        std::vector<uint64_t> rx_delays;
+        if (inst.session->trim_rx_delay && num_chan > 0) {
+            std::vector<uint64_t> delays;
+            if (get_delay_cal(inst, delays)) {
+                rx_delays.assign(delays.begin(), delays.begin() + std::min(delays.size(), num_chan));
+            } else {
+                mexWarnMsgTxt("txrx: no delay calibration for this rate and frequency");
+            }
+        }
+        double timing[3];
+        rx_result result = txrx_run(inst, std::string(tx_basepath), std::string(rx_basepath), num_samp_rx, chans, rx_delays, timing);
+        // Return gap map
+        if (nlhs >= 1) {
+            plhs[0] = gaps_to_mat(result.gaps);
+        }
+        if (nlhs >= 2) {
+            plhs[1] = mxCreateDoubleMatrix(1, 3, mxREAL);
+            std::copy(timing, timing + 3, mxGetDoubles(plhs[1]));
         }
-        // Return data
-        //plhs[0] = rx_data;
+        if (nlhs == 3) {
+            plhs[2] = outputs_to_mat(result.outputs);
+        }
+        return;
+    }
+
+    if (!strcmp("calibrate_delay", cmd)) {
+        calibrate_delay_sub(inst, nlhs, plhs, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("set_delay_trim", cmd)) {
+        set_delay_trim_sub(inst, nlhs, plhs, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("rx", cmd)) {
+        rx_sub(inst, nlhs, plhs, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("tx", cmd)) {
+        tx_sub(inst, nlhs, plhs, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("rx_files_start", cmd)) {
+        rx_files_start_sub(inst, nlhs, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("rx_files_stop", cmd)) {
+        rx_files_stop_sub(inst, nlhs, plhs, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("ring_start", cmd)) {
+        ring_start_sub(inst, nlhs, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("ring_trigger", cmd)) {
+        ring_trigger_sub(inst, nlhs, plhs, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("ring_stop", cmd)) {
+        // Stop streaming and release the buffer
+        inst.streams->ring.reset();
+        return;
+    }
+
+    if (!strcmp("set_stream_threads", cmd)) {
+        set_stream_threads_sub(inst, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("set_iq_correction", cmd)) {
+        set_iq_correction_sub(inst, nrhs, prhs);
+        return;
+    }
+
+    if (!strcmp("set_beamformer", cmd)) {
+        set_beamformer_sub(inst, nrhs, prhs);
         return;
     }
 
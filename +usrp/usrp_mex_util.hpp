@@ -8,60 +8,134 @@
 #pragma once
 
 #include "mex.h"
+#include "usrp_io.hpp"
+#include "usrp_ring.hpp"
+#include "usrp_wire.hpp"
 #include <ctype.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
 #include <vector>
 
+/* Options that can be changed after the session is created.  Each call to
+ * 'new' gets its own session, shared by the copies of its handle.  usrp_daemon
+ * runs the commands of one session one at a time, under lock.
+ */
+struct usrp_session
+{
+    std::mutex lock;
+    stream_thread_opts rx_thread;
+    stream_thread_opts tx_thread;
+    rx_processing rx_proc;
+    // tx to rx loopback delay of each channel in samples, keyed by
+    // (rate, fc), from calibrate_delay or the on-disk cache.  When
+    // trim_rx_delay is set, txrx starts rx that much later.
+    std::map<std::pair<double, double>, std::vector<uint64_t>> delay_cal;
+    bool trim_rx_delay = false;
+    // Measured start-up times of txrx bursts, keyed by (rate, number of
+    // channels, samples per tx buffer), for choosing the tx lead time
+    std::map<std::tuple<double, size_t, size_t>, tx_lead_stats> tx_lead;
+};
+
+/* Captures that keep the radio's rx streamer busy between commands.  These
+ * belong to the radio rather than to a session, so every session sees them
+ * and they outlive the client that started them.  usrp_daemon holds lock
+ * for every command that streams or reconfigures the radio.
+ */
+struct usrp_stream_state
+{
+    std::mutex lock;
+    std::shared_ptr<rx_ring> ring;
+    // Background capture to files started by rx_files_start
+    std::list<rx_thread_job> rx_file_jobs;
+    std::string rx_file_base;
+    uint64_t rx_file_segment_samps = 0;
+};
+
 class usrp_access
 {
 public:
     usrp_access(uhd::usrp::multi_usrp::sptr rx, uhd::usrp::multi_usrp::sptr tx) :
-            usrp_rx(rx), usrp_tx(tx) { }
+            usrp_rx(rx), usrp_tx(tx), session(std::make_shared<usrp_session>()),
+            streams(std::make_shared<usrp_stream_state>()) { }
     uhd::usrp::multi_usrp::sptr usrp_rx;
     uhd::usrp::multi_usrp::sptr usrp_tx;
     uhd::rx_streamer::sptr stream_rx;
     uhd::tx_streamer::sptr stream_tx;
+    // Used instead of stream_rx when rx channels are split across several
+    // streamers.  rx_group_chans[i] lists the channels of stream_rx_groups[i].
+    std::vector<uhd::rx_streamer::sptr> stream_rx_groups;
+    std::vector<std::vector<size_t>> rx_group_chans;
+    std::shared_ptr<usrp_session> session;
+    std::shared_ptr<usrp_stream_state> streams;
+    // Set for sessions that live in usrp_daemon; every command is forwarded
+    // there with daemon_handle in place of this handle
+    std::shared_ptr<daemon_client> daemon;
+    uint64_t daemon_handle = 0;
 };
 
-#define CLASS_HANDLE_SIGNATURE 0xFF00F0A5
-template<class base> class class_handle
+/* Handles given to Matlab are keys into this table rather than raw pointers,
+ * so a stale or corrupted handle (which the daemon may get from any client)
+ * is rejected instead of dereferenced.  The daemon's client threads share
+ * the table, so it is only used under handle_table_lock().
+ */
+inline std::map<uint64_t, std::shared_ptr<usrp_access>>& handle_table()
 {
-public:
-    class_handle(base ptr) : signature_m(CLASS_HANDLE_SIGNATURE), name_m(typeid(base).name()), ptr_m(ptr) {}
-    ~class_handle() { signature_m = 0; delete ptr_m; }
-    bool isValid() { return ((signature_m == CLASS_HANDLE_SIGNATURE) && !strcmp(name_m.c_str(), typeid(base).name())); }
-    base ptr() { return ptr_m; }
+    static std::map<uint64_t, std::shared_ptr<usrp_access>> table;
+    return table;
+}
 
-private:
-    uint32_t signature_m;
-    const std::string name_m;
-    base const ptr_m;
-};
+inline std::mutex& handle_table_lock()
+{
+    static std::mutex lock;
+    return lock;
+}
 
 inline mxArray *convertPtr2Mat(usrp_access ptr)
 {
+    static uint64_t next_handle = 1;
     mexLock();
     mxArray *out = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
-    *((uint64_t *)mxGetData(out)) = reinterpret_cast<uint64_t>(new class_handle<usrp_access>(ptr));
+    std::lock_guard<std::mutex> guard(handle_table_lock());
+    handle_table()[next_handle] = std::make_shared<usrp_access>(ptr);
+    *((uint64_t *)mxGetData(out)) = next_handle++;
     return out;
 }
 
+//! The session a handle refers to, or null if in isn't a live handle
+inline std::shared_ptr<usrp_access> findHandle(const mxArray *in)
+{
+    if (mxGetNumberOfElements(in) != 1 || mxGetClassID(in) != mxUINT64_CLASS || mxIsComplex(in))
+        return nullptr;
+    std::lock_guard<std::mutex> guard(handle_table_lock());
+    auto entry = handle_table().find(*((uint64_t *)mxGetData(in)));
+    return (entry == handle_table().end()) ? nullptr : entry->second;
+}
+
 inline usrp_access convertMat2Ptr(const mxArray *in)
 {
     if (mxGetNumberOfElements(in) != 1 || mxGetClassID(in) != mxUINT64_CLASS || mxIsComplex(in))
         mexErrMsgTxt("Input must be a real uint64 scalar.");
-    class_handle<usrp_access> *ptr = reinterpret_cast<class_handle<usrp_access> *>(*((uint64_t *)mxGetData(in)));
-    if (!ptr->isValid())
+    std::shared_ptr<usrp_access> inst = findHandle(in);
+    if (!inst)
         mexErrMsgTxt("Handle not valid.");
-    return ptr->ptr();
+    return *inst;
+}
+
+//! Forget a handle.  Its session goes once no running command holds it.
+inline void releaseHandle(uint64_t handle)
+{
+    std::lock_guard<std::mutex> guard(handle_table_lock());
+    handle_table().erase(handle);
 }
 
 inline void destroyObject(const mxArray *in)
 {
-	// Shared pointers can be destroyed by calling reset() on the sptr object
-	// http://lists.ettus.com/pipermail/usrp-users_lists.ettus.com/2015-December/045291.html
-	// Note that the attached thread says we can only do this 256 times
-    convertMat2Ptr(in).usrp_tx.reset();
-    convertMat2Ptr(in).usrp_rx.reset();
+    // The device itself stays open in global_usrp for the next handle
+    convertMat2Ptr(in).streams->ring.reset();
+    releaseHandle(*((uint64_t *)mxGetData(in)));
     // TODO will cause problems if we have more than 1 instance of the class
     // Either do reference counting or just remove 
     //mexUnlock();
@@ -0,0 +1,279 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "usrp_ring.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+rx_ring::rx_ring(uhd::usrp::multi_usrp::sptr usrp,
+    uhd::rx_streamer::sptr rx_stream,
+    const std::vector<size_t>& rx_channel_nums,
+    size_t capacity,
+    const std::string& backing_file)
+    : usrp(usrp), rx_stream(rx_stream), rx_channel_nums(rx_channel_nums),
+      capacity(capacity), backing_file(backing_file), ring_base(NULL), fd(-1),
+      num_written(0), stop_requested(false), writer_failed(false), writer_started(false)
+{
+    map_bytes = capacity * rx_channel_nums.size() * sizeof(std::complex<float>);
+    void *mem;
+    if (backing_file.empty()) {
+        mem = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+        fd = open(backing_file.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || ftruncate(fd, map_bytes) != 0) {
+            std::string err = strerror(errno);
+            if (fd >= 0) close(fd);
+            throw std::runtime_error("Failed to create ring file " + backing_file + ": " + err);
+        }
+        mem = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mem == MAP_FAILED) {
+        std::string err = strerror(errno);
+        if (fd >= 0) close(fd);
+        throw std::runtime_error("Failed to map ring buffer: " + err);
+    }
+    ring_base = (std::complex<float>*) mem;
+}
+
+rx_ring::~rx_ring()
+{
+    stop();
+    munmap(ring_base, map_bytes);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+//! Start streaming continuously at start_time (device time) into the ring
+void rx_ring::start(double start_time, const rx_processing& proc, const stream_thread_opts& thread_opts)
+{
+    stop();
+    // IQ correction is applied on the way in, but beams are formed when the
+    // window is written out, so the ring keeps every channel
+    this->proc = proc;
+    rate = usrp->get_rx_rate();
+    start_ticks = uhd::time_spec_t(start_time).to_ticks(rate);
+    num_written = 0;
+    stop_requested = false;
+    error = nullptr;
+    writer_failed = false;
+    writer_started = false;
+    gaps.clear();
+
+    uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_START_CONTINUOUS);
+    stream_cmd.stream_now = false;
+    stream_cmd.time_spec = uhd::time_spec_t(start_time);
+    rx_stream->issue_stream_cmd(stream_cmd);
+
+    thread = boost::thread([this, thread_opts]() {
+        try {
+            configure_stream_thread(thread_opts);
+            writer_loop();
+        } catch (...) {
+            error = std::current_exception();
+            writer_failed = true;
+        }
+    });
+}
+
+//! Stop streaming and wait for the writer; the ring contents are kept
+void rx_ring::stop()
+{
+    if (!thread.joinable()) {
+        return;
+    }
+    stop_requested = true;
+    thread.join();
+    uhd::stream_cmd_t stream_cmd(uhd::stream_cmd_t::STREAM_MODE_STOP_CONTINUOUS);
+    rx_stream->issue_stream_cmd(stream_cmd);
+    // Leave nothing for the next user of the streamer
+    drain_rx_stream(rx_stream);
+}
+
+//! Wait for the first packet to reach the ring.  If the writer fails first,
+//  e.g. because the start command was late, stop and throw its error.
+void rx_ring::wait_started()
+{
+    while (not writer_started and not writer_failed) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (writer_failed) {
+        stop();
+        std::rethrow_exception(error);
+    }
+}
+
+//! Append num_samps samples of every channel at num_written, wrapping around
+//  the end of the ring.  A null src writes zeros.
+void rx_ring::write_samples(const std::vector<std::complex<float>*>* src, size_t num_samps)
+{
+    size_t done = 0;
+    while (done < num_samps) {
+        size_t pos = (num_written + done) % capacity;
+        size_t len = std::min(num_samps - done, capacity - pos);
+        for (size_t i = 0; i < rx_channel_nums.size(); i++) {
+            std::complex<float> *dst = ring_base + i*capacity + pos;
+            if (src) {
+                memcpy(dst, (*src)[i] + done, len * sizeof(std::complex<float>));
+            } else {
+                std::fill(dst, dst + len, std::complex<float>());
+            }
+        }
+        done += len;
+    }
+    // Publish only once every channel has the samples
+    num_written += num_samps;
+}
+
+void rx_ring::writer_loop()
+{
+    const size_t spb = rx_stream->get_max_num_samps() * 10;
+    // Staging buffers, so dropped samples can be filled in before the data
+    // reaches the ring
+    std::vector<std::vector<std::complex<float>>> buffs(
+        rx_channel_nums.size(), std::vector<std::complex<float>>(spb));
+    std::vector<std::complex<float>*> buff_ptrs;
+    for (size_t i = 0; i < buffs.size(); i++) {
+        buff_ptrs.push_back(&buffs[i].front());
+    }
+    uhd::rx_metadata_t md;
+    double timeout = start_ticks / rate + 0.1; // first packet arrives at the start time
+
+    while (not stop_requested) {
+        size_t num_rx_samps = rx_stream->recv(buff_ptrs, spb, md, timeout);
+        timeout = 0.1;
+        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_TIMEOUT) {
+            throw std::runtime_error("Timeout while streaming into ring buffer");
+        }
+        if (md.error_code == uhd::rx_metadata_t::ERROR_CODE_OVERFLOW) {
+            // Continuous streaming resumes by itself; the gap is filled below
+            continue;
+        }
+        if (md.error_code != uhd::rx_metadata_t::ERROR_CODE_NONE) {
+            throw std::runtime_error(
+                str(boost::format("Receiver error %s") % md.strerror()));
+        }
+        if (md.has_time_spec) {
+            long long pkt_idx = md.time_spec.to_ticks(rate) - start_ticks;
+            if (pkt_idx > (long long) num_written) {
+                size_t missing = pkt_idx - num_written;
+                gaps.push_back(rx_gap{num_written, missing});
+                write_samples(NULL, missing);
+            }
+        }
+        process_rx_buffers(proc, buff_ptrs, rx_channel_nums, num_rx_samps);
+        write_samples(&buff_ptrs, num_rx_samps);
+        writer_started = true;
+    }
+}
+
+/* Wait until the window [trigger - num_pre, trigger + num_post) has been
+ * received, freeze the ring and write the window to files.  Samples from
+ * before the ring started are filled with zeros and reported as a gap.
+ */
+rx_result rx_ring::capture(uhd::time_spec_t trigger_time,
+    size_t num_pre,
+    size_t num_post,
+    const std::string& file,
+    double timeout)
+{
+    const size_t spb = rx_stream->get_max_num_samps() * 10;
+    if (proc.num_beams > 0 && proc.beam_weights.size() != proc.num_beams * rx_channel_nums.size()) {
+        throw std::runtime_error("Beamforming weights do not match the ring's channels");
+    }
+    if (num_pre + num_post + spb > capacity) {
+        throw std::runtime_error("Capture window does not fit in the ring buffer");
+    }
+    long long trigger_idx = trigger_time.to_ticks(rate) - start_ticks;
+    long long window_start = trigger_idx - (long long) num_pre;
+    long long window_end = trigger_idx + (long long) num_post;
+
+    // Wait for the post-trigger samples
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration<double>(timeout + (double) num_post / rate);
+    while ((long long) num_written < window_end and not writer_failed) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            stop();
+            throw std::runtime_error("Timeout waiting for post-trigger samples");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stop();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (window_start < (long long) num_written - (long long) capacity) {
+        throw std::runtime_error("Pre-trigger samples were overwritten; use a larger ring");
+    }
+
+    // Beams are formed here, on the way out of the ring
+    std::vector<size_t> out_ids = rx_channel_nums;
+    std::vector<std::vector<std::complex<float>>> beam_buffs;
+    std::vector<std::complex<float>*> beam_ptrs;
+    if (proc.num_beams > 0) {
+        out_ids.clear();
+        beam_buffs.resize(proc.num_beams, std::vector<std::complex<float>>(spb));
+        for (size_t k = 0; k < proc.num_beams; k++) {
+            out_ids.push_back(k);
+            beam_ptrs.push_back(&beam_buffs[k].front());
+        }
+    }
+    std::vector<boost::shared_ptr<std::ofstream>> outfiles;
+    for (size_t i = 0; i < out_ids.size(); i++) {
+        const std::string this_filename = generate_out_filename(file, out_ids.size(), out_ids[i]);
+        outfiles.push_back(boost::shared_ptr<std::ofstream>(
+            new std::ofstream(this_filename.c_str(), std::ofstream::binary)));
+    }
+
+    rx_result result;
+    result.num_samps = window_end - window_start;
+    result.outputs = out_ids;
+    const std::vector<std::complex<float>> zero_buff(spb);
+    long long idx = window_start;
+    while (idx < window_end) {
+        size_t len;
+        std::vector<std::complex<float>*> chan_ptrs;
+        if (idx < 0) {
+            // Before the ring started
+            len = std::min<long long>(-idx, std::min<long long>(spb, window_end - idx));
+            for (size_t i = 0; i < rx_channel_nums.size(); i++) {
+                chan_ptrs.push_back(const_cast<std::complex<float>*>(&zero_buff.front()));
+            }
+            result.gaps.push_back(rx_gap{(uint64_t) (idx - window_start), len});
+        } else {
+            size_t pos = idx % capacity;
+            len = std::min<long long>(std::min<long long>(spb, window_end - idx), capacity - pos);
+            for (size_t i = 0; i < rx_channel_nums.size(); i++) {
+                chan_ptrs.push_back(ring_base + i*capacity + pos);
+            }
+        }
+        if (proc.num_beams > 0) {
+            beamform(proc, chan_ptrs, beam_ptrs, len);
+            chan_ptrs = beam_ptrs;
+        }
+        for (size_t i = 0; i < outfiles.size(); i++) {
+            outfiles[i]->write((const char*) chan_ptrs[i], len * sizeof(std::complex<float>));
+        }
+        idx += len;
+    }
+    for (size_t i = 0; i < outfiles.size(); i++) {
+        outfiles[i]->close();
+    }
+
+    // Report drops that fall inside the window
+    for (const rx_gap& gap : gaps) {
+        long long gap_start = std::max<long long>(gap.start, window_start);
+        long long gap_end = std::min<long long>(gap.start + gap.length, window_end);
+        if (gap_start < gap_end) {
+            result.gaps.push_back(rx_gap{(uint64_t) (gap_start - window_start),
+                (uint64_t) (gap_end - gap_start)});
+        }
+    }
+    return result;
+}
@@ -0,0 +1,76 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//// Continuous rx into a circular buffer, for pre-trigger captures
+
+#pragma once
+
+#include <uhd/usrp/multi_usrp.hpp>
+#include <boost/thread/thread.hpp>
+#include <atomic>
+#include <exception>
+#include "usrp_dsp.hpp"
+#include "usrp_io.hpp"
+
+/* Receives continuously into a circular buffer holding the most recent
+ * capacity samples of every channel.  On a trigger, capture() waits for the
+ * post-trigger samples, freezes the ring (stops streaming) and writes the
+ * window around the trigger to files, just like recv_to_file.  Call start()
+ * again to re-arm.
+ *
+ * The buffer is an anonymous mapping, or a shared mapping of backing_file if
+ * one is given, so rings larger than RAM can spill to disk.
+ */
+class rx_ring
+{
+public:
+    rx_ring(uhd::usrp::multi_usrp::sptr usrp,
+        uhd::rx_streamer::sptr rx_stream,
+        const std::vector<size_t>& rx_channel_nums,
+        size_t capacity,
+        const std::string& backing_file);
+    ~rx_ring();
+
+    void start(double start_time, const rx_processing& proc, const stream_thread_opts& thread_opts);
+    void stop();
+    void wait_started();
+    bool running() const { return thread.joinable(); }
+    size_t get_capacity() const { return capacity; }
+    size_t get_num_channels() const { return rx_channel_nums.size(); }
+    const std::string& get_backing_file() const { return backing_file; }
+
+    rx_result capture(uhd::time_spec_t trigger_time,
+        size_t num_pre,
+        size_t num_post,
+        const std::string& file,
+        double timeout);
+
+private:
+    void writer_loop();
+    void write_samples(const std::vector<std::complex<float>*>* src, size_t num_samps);
+
+    uhd::usrp::multi_usrp::sptr usrp;
+    uhd::rx_streamer::sptr rx_stream;
+    std::vector<size_t> rx_channel_nums;
+    size_t capacity;
+    std::string backing_file;
+    std::complex<float> *ring_base;
+    size_t map_bytes;
+    int fd;
+
+    rx_processing proc;
+    double rate;
+    long long start_ticks;
+    // Index (relative to the start time) of the next sample to be written
+    std::atomic<uint64_t> num_written;
+    std::atomic<bool> stop_requested;
+    std::atomic<bool> writer_failed;
+    // Set once the first packet has reached the ring
+    std::atomic<bool> writer_started;
+    boost::thread thread;
+    std::exception_ptr error;
+    // Dropped runs filled with zeros, as absolute indices; only read once the
+    // writer has been joined
+    std::vector<rx_gap> gaps;
+};
@@ -0,0 +1,245 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "usrp_wire.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Array types on the wire.  Matlab's class IDs aren't used directly since the
+// daemon's mex.h numbers them differently.
+enum wire_type : uint8_t {
+    WIRE_DOUBLE,
+    WIRE_SINGLE,
+    WIRE_UINT8,
+    WIRE_UINT32,
+    WIRE_UINT64,
+    WIRE_LOGICAL,
+    WIRE_CHAR
+};
+
+// Refuse arrays bigger than this rather than trusting a corrupt header
+#define WIRE_MAX_BYTES (1ull << 32)
+
+std::string default_daemon_socket()
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    return std::string((dir && *dir) ? dir : "/tmp") + "/usrp_daemon.sock";
+}
+
+bool wire_write(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *) buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool wire_read(int fd, void *buf, size_t len)
+{
+    char *p = (char *) buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool wire_write_string(int fd, const std::string& str)
+{
+    uint64_t len = str.size();
+    return wire_write(fd, &len, sizeof(len)) && wire_write(fd, str.data(), len);
+}
+
+bool wire_read_string(int fd, std::string& str)
+{
+    uint64_t len;
+    if (!wire_read(fd, &len, sizeof(len)) || len > WIRE_MAX_BYTES)
+        return false;
+    str.resize(len);
+    return wire_read(fd, &str[0], len);
+}
+
+static bool wire_can_send(const mxArray *arr)
+{
+    switch (mxGetClassID(arr)) {
+        case mxDOUBLE_CLASS:
+        case mxSINGLE_CLASS:
+        case mxUINT8_CLASS:
+        case mxUINT32_CLASS:
+        case mxUINT64_CLASS:
+        case mxLOGICAL_CLASS:
+        case mxCHAR_CLASS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool wire_write_array(int fd, const mxArray *arr)
+{
+    uint8_t hdr[2] = {0, (uint8_t) mxIsComplex(arr)};
+    uint64_t dims[2] = {mxGetM(arr), mxGetN(arr)};
+    switch (mxGetClassID(arr)) {
+        case mxDOUBLE_CLASS: hdr[0] = WIRE_DOUBLE; break;
+        case mxSINGLE_CLASS: hdr[0] = WIRE_SINGLE; break;
+        case mxUINT8_CLASS: hdr[0] = WIRE_UINT8; break;
+        case mxUINT32_CLASS: hdr[0] = WIRE_UINT32; break;
+        case mxUINT64_CLASS: hdr[0] = WIRE_UINT64; break;
+        case mxLOGICAL_CLASS: hdr[0] = WIRE_LOGICAL; break;
+        case mxCHAR_CLASS: {
+            // Matlab stores UTF-16, so send the converted string instead
+            char *str = mxArrayToString(arr);
+            if (str == NULL) return false;
+            hdr[0] = WIRE_CHAR;
+            bool ok = wire_write(fd, hdr, sizeof(hdr)) && wire_write_string(fd, std::string(str));
+            mxFree(str);
+            return ok;
+        }
+        default:
+            return false;
+    }
+    return wire_write(fd, hdr, sizeof(hdr)) && wire_write(fd, dims, sizeof(dims))
+        && wire_write(fd, mxGetData(arr), mxGetNumberOfElements(arr) * mxGetElementSize(arr));
+}
+
+mxArray *wire_read_array(int fd)
+{
+    uint8_t hdr[2];
+    if (!wire_read(fd, hdr, sizeof(hdr)))
+        return NULL;
+    if (hdr[0] == WIRE_CHAR) {
+        std::string str;
+        if (!wire_read_string(fd, str))
+            return NULL;
+        return mxCreateString(str.c_str());
+    }
+    uint64_t dims[2];
+    if (!wire_read(fd, dims, sizeof(dims)))
+        return NULL;
+    // Check the size before allocating anything, without overflowing
+    uint64_t elem_size;
+    switch (hdr[0]) {
+        case WIRE_DOUBLE: case WIRE_UINT64: elem_size = 8; break;
+        case WIRE_SINGLE: case WIRE_UINT32: elem_size = 4; break;
+        case WIRE_UINT8: case WIRE_LOGICAL: elem_size = 1; break;
+        default: return NULL;
+    }
+    if (hdr[1]) {
+        elem_size *= 2;
+    }
+    uint64_t max_elems = WIRE_MAX_BYTES / elem_size;
+    if (dims[0] > max_elems || (dims[0] > 0 && dims[1] > max_elems / dims[0]))
+        return NULL;
+    mxComplexity complexity = hdr[1] ? mxCOMPLEX : mxREAL;
+    mxArray *arr;
+    switch (hdr[0]) {
+        case WIRE_DOUBLE: arr = mxCreateNumericMatrix(dims[0], dims[1], mxDOUBLE_CLASS, complexity); break;
+        case WIRE_SINGLE: arr = mxCreateNumericMatrix(dims[0], dims[1], mxSINGLE_CLASS, complexity); break;
+        case WIRE_UINT8: arr = mxCreateNumericMatrix(dims[0], dims[1], mxUINT8_CLASS, complexity); break;
+        case WIRE_UINT32: arr = mxCreateNumericMatrix(dims[0], dims[1], mxUINT32_CLASS, complexity); break;
+        case WIRE_UINT64: arr = mxCreateNumericMatrix(dims[0], dims[1], mxUINT64_CLASS, complexity); break;
+        case WIRE_LOGICAL: arr = mxCreateLogicalMatrix(dims[0], dims[1]); break;
+        default: return NULL;
+    }
+    size_t len = mxGetNumberOfElements(arr) * mxGetElementSize(arr);
+    if (!wire_read(fd, mxGetData(arr), len)) {
+        mxDestroyArray(arr);
+        return NULL;
+    }
+    return arr;
+}
+
+daemon_client::daemon_client(const std::string& socket_path)
+{
+    struct sockaddr_un addr;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Daemon socket path too long: " + socket_path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        std::string err = strerror(errno);
+        if (fd >= 0) ::close(fd);
+        throw std::runtime_error("Failed to connect to usrp_daemon at " + socket_path + ": " + err);
+    }
+}
+
+daemon_client::~daemon_client()
+{
+    close();
+}
+
+void daemon_client::close()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void daemon_client::call(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    // mexErrMsgTxt doesn't return, so the lock must be released before
+    // reporting anything
+    std::string err;
+    std::vector<mxArray *> outs;
+    for (int ii = 0; ii < nrhs; ii++) {
+        if (!wire_can_send(prhs[ii]))
+            mexErrMsgTxt("usrp_daemon: unsupported argument type");
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        uint32_t counts[2] = {(uint32_t) nlhs, (uint32_t) nrhs};
+        bool ok = (fd >= 0) && wire_write(fd, counts, sizeof(counts));
+        for (int ii = 0; ok && ii < nrhs; ii++) {
+            ok = wire_write_array(fd, prhs[ii]);
+        }
+        uint8_t status;
+        ok = ok && wire_read(fd, &status, sizeof(status));
+        if (ok && status != WIRE_STATUS_OK) {
+            ok = wire_read_string(fd, err);
+        } else if (ok) {
+            uint32_t nout;
+            ok = wire_read(fd, &nout, sizeof(nout));
+            for (uint32_t ii = 0; ok && ii < nout; ii++) {
+                mxArray *arr = wire_read_array(fd);
+                ok = (arr != NULL);
+                if (ok) outs.push_back(arr);
+            }
+        }
+        if (!ok) {
+            // The stream is out of step now, so it can't be reused
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            if (err.empty()) err = "usrp_daemon: connection lost";
+        }
+    }
+    if (!err.empty()) {
+        for (mxArray *arr : outs) mxDestroyArray(arr);
+        mexErrMsgTxt(err.c_str());
+    }
+    for (size_t ii = 0; ii < outs.size(); ii++) {
+        if ((int) ii < nlhs) {
+            plhs[ii] = outs[ii];
+        } else {
+            mxDestroyArray(outs[ii]);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+//
+// Copyright 2019 Tim Woodford
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+//// Control socket protocol between usrp_mex and usrp_daemon
+
+#pragma once
+
+#include "mex.h"
+#include <mutex>
+#include <string>
+
+/* Each call is sent as [nlhs u32][nrhs u32] followed by the nrhs arguments,
+ * and answered with [status u8] and then either an error message or
+ * [nout u32] and the outputs.  An array is [type u8][complex u8][m u64][n u64]
+ * and its raw (interleaved complex) data.  Sample data doesn't go over the
+ * socket; it is exchanged through files in a RAM-backed directory, as before.
+ */
+#define WIRE_STATUS_OK 0
+#define WIRE_STATUS_ERROR 1
+
+//! Socket used when no path is given: $XDG_RUNTIME_DIR/usrp_daemon.sock
+std::string default_daemon_socket();
+
+bool wire_write(int fd, const void *buf, size_t len);
+bool wire_read(int fd, void *buf, size_t len);
+bool wire_write_string(int fd, const std::string& str);
+bool wire_read_string(int fd, std::string& str);
+//! Returns false for array types the daemon doesn't accept
+bool wire_write_array(int fd, const mxArray *arr);
+//! Returns NULL if the connection failed or the array was malformed
+mxArray *wire_read_array(int fd);
+
+/* Connection to a daemon, held by the handles usrp_mex gives out for daemon
+ * sessions.  Calls are serialized so handles copied into several Matlab
+ * objects can share it.
+ */
+class daemon_client
+{
+public:
+    daemon_client(const std::string& socket_path);
+    ~daemon_client();
+    //! Run a usrp_mex command in the daemon; errors are raised with mexErrMsgTxt
+    void call(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+    void close();
+
+private:
+    int fd;
+    std::mutex lock;
+};